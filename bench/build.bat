@@ -0,0 +1,2 @@
+cls
+gcc main.c -o bench.exe -std=c99 -Wall -lgdi32 -luser32 -lwinmm -O2 -s
\ No newline at end of file
@@ -0,0 +1 @@
+gcc main.c -o bench -std=c99 -Wall -O2 -s -lm -lpthread
\ No newline at end of file
@@ -0,0 +1,479 @@
+// headless benchmarks for the draw, decode and encode paths. kit is built with
+// KIT_HEADLESS so every workload draws into an offscreen screen image; the
+// checksum printed beside each result is the framebuffer (or decoded pixels)
+// after one run, so kernel changes can be checked against a reference build.
+//
+// usage: bench [-d] [-t threads] [file.png ...]
+//   -d  use deferred drawing
+//   -t  replay deferred draws on n threads (implies -d)
+//   extra png files are added to the decode corpus
+
+#ifndef KIT_HEADLESS
+#define KIT_HEADLESS
+#endif
+#define KIT_IMPL
+#include "../kit.h"
+#include "../demo/assets.h"
+
+#define SCREEN_W 640
+#define SCREEN_H 360
+#define WARMUP   2
+#define REPS     7
+
+typedef struct {
+    int64_t calls;
+    int64_t pixels;
+    int64_t bytes;
+    uint32_t checksum;
+} Stats;
+
+typedef struct {
+    char *name;
+    void (*run)(kit_Context *ctx, Stats *s);
+} Bench;
+
+typedef struct {
+    void *data;
+    int len;
+} PngFile;
+
+static uint32_t seed;
+static kit_Image *sprites, *big;
+static kit_Image *tiles[256], *tile_pages[256];
+static kit_Rect tile_rects[256];
+static kit_Atlas *atlas;
+static kit_Image *sheet;
+static kit_Tilemap *map;
+static PngFile corpus[64];
+static int corpus_count;
+
+static char *strings[] = {
+    "Hello, World!", "The quick brown fox", "jumps over the lazy dog",
+    "0123456789", "Score: 1337", "Press any key", "GAME OVER", "kit",
+};
+
+
+static int rnd(int n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+
+static kit_Color rnd_color(int alpha) {
+    int r = rnd(256);
+    int g = rnd(256);
+    int b = rnd(256);
+    return kit_rgba(r, g, b, alpha);
+}
+
+
+static uint32_t hash(uint32_t h, void *data, int len) {
+    for (uint8_t *p = data; len--; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+static void count(Stats *s, int64_t pixels) {
+    s->calls++;
+    s->pixels += pixels;
+    s->bytes += pixels * sizeof(kit_Color);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Workloads
+//////////////////////////////////////////////////////////////////////////////
+
+static void bench_rect_fill(kit_Context *ctx, Stats *s) {
+    for (int i = 0; i < 4000; i++) {
+        int x = rnd(SCREEN_W - 16);
+        int y = rnd(SCREEN_H - 16);
+        kit_draw_rect(ctx, rnd_color(0xff), kit_rect(x, y, 16, 16));
+        count(s, 16 * 16);
+    }
+}
+
+
+static void bench_rect_blend(kit_Context *ctx, Stats *s) {
+    for (int i = 0; i < 4000; i++) {
+        int x = rnd(SCREEN_W - 16);
+        int y = rnd(SCREEN_H - 16);
+        kit_draw_rect(ctx, rnd_color(0x80), kit_rect(x, y, 16, 16));
+        count(s, 16 * 16);
+    }
+}
+
+
+static void bench_rect_large(kit_Context *ctx, Stats *s) {
+    for (int i = 0; i < 20; i++) {
+        kit_draw_rect(ctx, rnd_color(0x40), kit_rect(0, 0, SCREEN_W, SCREEN_H));
+        count(s, SCREEN_W * SCREEN_H);
+    }
+}
+
+
+// the same sprite frames drawn one call each and as a single batch
+static void bench_sprites(kit_Context *ctx, Stats *s, bool batched) {
+    static kit_Sprite batch[4000];
+    for (int i = 0; i < 4000; i++) {
+        int x = rnd(SCREEN_W - 9);
+        int y = rnd(SCREEN_H - 19);
+        int frame = rnd(12);
+        if (batched) {
+            batch[i] = (kit_Sprite) { x, y, kit_rect(frame * 9, 0, 9, 19) };
+        } else {
+            kit_draw_image2(ctx, KIT_WHITE, sprites, x, y, kit_rect(frame * 9, 0, 9, 19));
+        }
+        count(s, 9 * 19);
+    }
+    if (batched) {
+        kit_draw_sprites(ctx, sprites, batch, 4000);
+    }
+}
+
+
+static void bench_sprites_each(kit_Context *ctx, Stats *s) {
+    bench_sprites(ctx, s, false);
+}
+
+
+static void bench_sprites_batch(kit_Context *ctx, Stats *s) {
+    bench_sprites(ctx, s, true);
+}
+
+
+// the same small images drawn from separate allocations and from an atlas
+static void bench_tiles(kit_Context *ctx, Stats *s, bool from_atlas) {
+    for (int i = 0; i < 4000; i++) {
+        int x = rnd(SCREEN_W - 16);
+        int y = rnd(SCREEN_H - 16);
+        int t = rnd(kit_lengthof(tiles));
+        if (from_atlas) {
+            kit_draw_image2(ctx, KIT_WHITE, tile_pages[t], x, y, tile_rects[t]);
+        } else {
+            kit_draw_image(ctx, tiles[t], x, y);
+        }
+        count(s, tiles[t]->w * tiles[t]->h);
+    }
+}
+
+
+static void bench_tiles_heap(kit_Context *ctx, Stats *s) {
+    bench_tiles(ctx, s, false);
+}
+
+
+static void bench_tiles_atlas(kit_Context *ctx, Stats *s) {
+    bench_tiles(ctx, s, true);
+}
+
+
+// a two-layer scrolling map, drawn tile by tile (visible tiles only) and
+// through the chunk cache
+static void bench_tilemap(kit_Context *ctx, Stats *s, bool cached) {
+    for (int i = 0; i < 16; i++) {
+        int sx = 100 + i * 13, sy = 60 + i * 7;
+        if (cached) {
+            kit_draw_tilemap(ctx, map, -sx, -sy);
+        } else {
+            for (int l = 0; l < 2; l++) {
+                for (int ty = sy / 16; ty <= (sy + SCREEN_H - 1) / 16; ty++) {
+                    for (int tx = sx / 16; tx <= (sx + SCREEN_W - 1) / 16; tx++) {
+                        int t = kit_get_tile(map, l, tx, ty) - 1;
+                        if (t < 0) { continue; }
+                        kit_draw_image2(ctx, KIT_WHITE, sheet, tx * 16 - sx, ty * 16 - sy, kit_rect(t % 8 * 16, t / 8 * 16, 16, 16));
+                    }
+                }
+            }
+        }
+        count(s, SCREEN_W * SCREEN_H);
+    }
+}
+
+
+static void bench_tilemap_tiles(kit_Context *ctx, Stats *s) {
+    bench_tilemap(ctx, s, false);
+}
+
+
+static void bench_tilemap_cache(kit_Context *ctx, Stats *s) {
+    bench_tilemap(ctx, s, true);
+}
+
+
+static void bench_blit(kit_Context *ctx, Stats *s, kit_Color mul, kit_Color add) {
+    int w = big->w * 5 / 4, h = big->h * 5 / 4;
+    for (int i = 0; i < 50; i++) {
+        int x = rnd(SCREEN_W - w);
+        int y = rnd(SCREEN_H - h);
+        kit_draw_image3(ctx, mul, add, big, kit_rect(x, y, w, h), kit_rect(0, 0, big->w, big->h));
+        count(s, w * h);
+    }
+}
+
+
+static void bench_blit_plain(kit_Context *ctx, Stats *s) {
+    bench_blit(ctx, s, KIT_WHITE, KIT_BLACK);
+}
+
+
+static void bench_blit_mul(kit_Context *ctx, Stats *s) {
+    bench_blit(ctx, s, kit_rgba(0xff, 0x80, 0x40, 0xc0), KIT_BLACK);
+}
+
+
+static void bench_blit_muladd(kit_Context *ctx, Stats *s) {
+    bench_blit(ctx, s, kit_rgba(0xff, 0x80, 0x40, 0xc0), kit_rgb(0x20, 0x10, 0x00));
+}
+
+
+// the blit source rotated and scaled about its centre
+static void bench_affine(kit_Context *ctx, Stats *s) {
+    for (int i = 0; i < 50; i++) {
+        float a = i * 0.37f, sc = 0.75f + (i % 4) * 0.25f;
+        float c = cosf(a) * sc, n = sinf(a) * sc;
+        float x = rnd(SCREEN_W), y = rnd(SCREEN_H);
+        float m[6] = { c, -n, x - (c * big->w - n * big->h) / 2, n, c, y - (n * big->w + c * big->h) / 2 };
+        kit_draw_image_affine(ctx, KIT_WHITE, KIT_BLACK, big, kit_rect(0, 0, big->w, big->h), m);
+        count(s, big->w * big->h * sc * sc);
+    }
+}
+
+
+static void bench_lines(kit_Context *ctx, Stats *s) {
+    for (int i = 0; i < 4000; i++) {
+        int x1 = rnd(SCREEN_W), y1 = rnd(SCREEN_H);
+        int x2 = rnd(SCREEN_W), y2 = rnd(SCREEN_H);
+        kit_draw_line(ctx, rnd_color(0xc0), x1, y1, x2, y2);
+        count(s, kit_max(abs(x2 - x1), abs(y2 - y1)) + 1);
+    }
+}
+
+
+static void bench_text(kit_Context *ctx, Stats *s) {
+    int h = ctx->font->glyphs['A'].rect.h;
+    for (int i = 0; i < 2000; i++) {
+        char *str = strings[rnd(kit_lengthof(strings))];
+        int w = kit_text_width(ctx->font, str);
+        int x = rnd(SCREEN_W - w);
+        int y = rnd(SCREEN_H - h);
+        kit_draw_text2(ctx, rnd_color(0xff), ctx->font, str, x, y);
+        count(s, w * h);
+    }
+}
+
+
+static void bench_text_uncached(kit_Context *ctx, Stats *s) {
+    kit_set_text_cache(ctx, ctx->font, 0);
+    bench_text(ctx, s);
+    kit_set_text_cache(ctx, ctx->font, KIT_TEXT_CACHE_SIZE);
+}
+
+
+static void bench_png(kit_Context *ctx, Stats *s) {
+    for (int n = 0; n < 20; n++) {
+        for (int i = 0; i < corpus_count; i++) {
+            kit_Image *img = kit_load_image_mem(corpus[i].data, corpus[i].len);
+            if (!img) { continue; }
+            s->calls++;
+            s->pixels += img->w * img->h;
+            s->bytes += corpus[i].len;
+            if (n == 0) {
+                s->checksum = hash(s->checksum, img->pixels, img->w * img->h * sizeof(kit_Color));
+            }
+            kit_destroy_image(img);
+        }
+    }
+}
+
+
+// a screenshot-like frame: flat background, overlapping rects and text
+static void bench_png_encode(kit_Context *ctx, Stats *s, int mode) {
+    kit_clear(ctx, kit_rgb(20, 30, 40));
+    for (int i = 0; i < 200; i++) {
+        kit_draw_rect(ctx, rnd_color(0xc0), kit_rect(rnd(SCREEN_W), rnd(SCREEN_H), rnd(80), rnd(80)));
+    }
+    for (int i = 0; i < 50; i++) {
+        kit_draw_text(ctx, KIT_WHITE, strings[rnd(kit_lengthof(strings))], rnd(SCREEN_W), rnd(SCREEN_H));
+    }
+    kit_flush(ctx);
+
+    for (int n = 0; n < 10; n++) {
+        int len;
+        void *png = kit_save_image_mem(ctx->screen, mode, &len);
+        count(s, SCREEN_W * SCREEN_H);
+        if (n == 0) { s->checksum = hash(2166136261u, png, len); }
+        free(png);
+    }
+}
+
+
+static void bench_png_fast(kit_Context *ctx, Stats *s) {
+    bench_png_encode(ctx, s, KIT_SAVE_FAST);
+}
+
+
+static void bench_png_small(kit_Context *ctx, Stats *s) {
+    bench_png_encode(ctx, s, KIT_SAVE_SMALL);
+}
+
+
+static Bench benches[] = {
+    { "rect_fill",     bench_rect_fill     },
+    { "rect_blend",    bench_rect_blend    },
+    { "rect_large",    bench_rect_large    },
+    { "sprites",       bench_sprites_each  },
+    { "sprites_batch", bench_sprites_batch },
+    { "tiles_heap",    bench_tiles_heap    },
+    { "tiles_atlas",   bench_tiles_atlas   },
+    { "tilemap_tiles", bench_tilemap_tiles },
+    { "tilemap",       bench_tilemap_cache },
+    { "blit_plain",    bench_blit_plain    },
+    { "blit_mul",      bench_blit_mul      },
+    { "blit_muladd",   bench_blit_muladd   },
+    { "affine",        bench_affine        },
+    { "lines",         bench_lines         },
+    { "text",          bench_text          },
+    { "text_uncached", bench_text_uncached },
+    { "png_decode",    bench_png           },
+    { "png_fast",      bench_png_fast      },
+    { "png_small",     bench_png_small     },
+};
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Driver
+//////////////////////////////////////////////////////////////////////////////
+
+// every run starts from the same screen contents and random seed so its
+// checksum is reproducible
+static double run_once(kit_Context *ctx, Bench *b, Stats *s) {
+    seed = 1;
+    for (int i = 0; i < SCREEN_W * SCREEN_H; i++) {
+        ctx->screen->pixels[i].w = (seed = seed * 1103515245 + 12345) | 0xff000000;
+    }
+    memset(s, 0, sizeof(*s));
+    seed = 1;
+
+    double t = kit__now();
+    b->run(ctx, s);
+    kit_flush(ctx);
+    t = kit__now() - t;
+
+    if (!s->checksum) {
+        s->checksum = hash(2166136261u, ctx->screen->pixels, SCREEN_W * SCREEN_H * sizeof(kit_Color));
+    }
+    kit_step(ctx, NULL);
+    return t;
+}
+
+
+static void add_png(void *data, int len) {
+    if (corpus_count < kit_lengthof(corpus)) {
+        corpus[corpus_count++] = (PngFile) { data, len };
+    }
+}
+
+
+int main(int argc, char **argv) {
+    add_png(sprite_png, sizeof(sprite_png));
+    add_png(corner_png, sizeof(corner_png));
+    add_png(cursor_png, sizeof(cursor_png));
+    add_png(kit__font_png_data, kit__font_png_size);
+
+    int flags = KIT_FPSINF, threads = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d")) {
+            flags |= KIT_DEFERRED;
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else {
+            // mapped for the life of the process
+            size_t len;
+            void *data = kit_map_file(argv[i], &len);
+            if (!data) { fprintf(stderr, "could not read %s\n", argv[i]); return 1; }
+            add_png(data, len);
+        }
+    }
+
+    // headless, so this is just a screen image to draw into
+    kit_Context *ctx = kit_create("bench", SCREEN_W, SCREEN_H, flags);
+    if (threads) { kit_set_threads(ctx, threads); }
+
+    // the large blit source is a gradient with opaque, translucent and
+    // transparent texels so every branch of the blend spans is hit
+    sprites = kit_load_image_mem(sprite_png, sizeof(sprite_png));
+    big = kit_create_image(192, 256);
+    for (int y = 0; y < big->h; y++) {
+        for (int x = 0; x < big->w; x++) {
+            int a = (x / 16 + y / 16) % 4;
+            big->pixels[x + y * big->w] = kit_rgba(x, y, x ^ y, a == 0 ? 0 : a == 1 ? 0xff : x + y);
+        }
+    }
+    kit_premultiply_image(big);
+
+    // small translucent tiles, allocated one by one with other allocations
+    // in between, and packed into an atlas
+    atlas = kit_create_atlas(256, 256);
+    for (int i = 0; i < kit_lengthof(tiles); i++) {
+        int w = 8 + i % 9, h = 8 + i / 32;
+        tiles[i] = kit_create_image(w, h);
+        for (int j = 0; j < w * h; j++) {
+            tiles[i]->pixels[j] = kit_rgba(i, j * 7, i ^ j, j % 5 == 0 ? 0 : j % 3 == 0 ? 0x80 : 0xff);
+        }
+        kit_premultiply_image(tiles[i]);
+        free(malloc(4096));
+        tile_pages[i] = kit_atlas_add(atlas, tiles[i], &tile_rects[i]);
+    }
+
+    // an opaque ground layer under a sparse cut-out one, 256x128 tiles
+    seed = 1;
+    sheet = kit_create_image(128, 64);
+    for (int i = 0; i < sheet->w * sheet->h; i++) {
+        sheet->pixels[i] = rnd_color(i / sheet->w >= 32 && rnd(3) == 0 ? 0 : 0xff);
+    }
+    kit_premultiply_image(sheet);
+    map = kit_create_tilemap(sheet, 16, 16, 256, 128, 2);
+    for (int y = 0; y < 128; y++) {
+        for (int x = 0; x < 256; x++) {
+            kit_set_tile(map, 0, x, y, 1 + rnd(16));
+            if (rnd(4) == 0) { kit_set_tile(map, 1, x, y, 17 + rnd(16)); }
+        }
+    }
+
+    printf("%dx%d screen, %s, %d threads\n", SCREEN_W, SCREEN_H,
+        ctx->deferred ? "deferred" : "immediate", ctx->thread_count + 1);
+    printf("%-14s %12s %12s %12s %10s\n", "workload", "ns/call", "Mpix/s", "MB/s", "checksum");
+
+    for (int i = 0; i < kit_lengthof(benches); i++) {
+        Bench *b = &benches[i];
+        Stats s, first;
+        for (int j = 0; j < WARMUP; j++) { run_once(ctx, b, &s); }
+
+        // report the best of REPS runs; a checksum that changes between
+        // runs means the workload isn't deterministic
+        double best = 1e30;
+        bool stable = true;
+        for (int j = 0; j < REPS; j++) {
+            best = kit_min(best, run_once(ctx, b, &s));
+            if (j == 0) { first = s; }
+            stable = stable && s.checksum == first.checksum;
+        }
+
+        printf("%-14s %12.1f %12.2f %12.2f   %08x%s\n", b->name,
+            best * 1e9 / s.calls, s.pixels / best / 1e6, s.bytes / best / 1e6,
+            s.checksum, stable ? "" : " (unstable)");
+    }
+
+    kit_destroy_image(sprites);
+    kit_destroy_image(big);
+    for (int i = 0; i < kit_lengthof(tiles); i++) { kit_destroy_image(tiles[i]); }
+    kit_destroy_atlas(atlas);
+    kit_destroy_tilemap(map);
+    kit_destroy_image(sheet);
+    kit_destroy(ctx);
+    return 0;
+}
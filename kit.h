@@ -3,6 +3,17 @@
 #ifndef KIT_H
 #define KIT_H
 
+// KIT_HEADLESS builds without a window: kit_create() only allocates the
+// screen, kit_step() paces time and input comes from kit_inject_*(). it is
+// the default off windows, where kit.h should be included before any system
+// header so clock_gettime() and friends are visible
+#if !defined(_WIN32) && !defined(KIT_HEADLESS)
+#define KIT_HEADLESS
+#endif
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -12,10 +23,47 @@
 #include <setjmp.h>
 #include <time.h>
 #include <math.h>
+#ifdef _WIN32
 #include <windows.h>
 #include <windowsx.h>
+#else
+#include <pthread.h>
+#endif
+
+// KIT_PREMULTIPLIED keeps image pixels in premultiplied alpha, which makes
+// blending and tinting cheaper. colors passed to the api are straight alpha
+// either way; pixels written by hand go through kit_premultiply_image()
+// #define KIT_PREMULTIPLIED
+
+#ifndef KIT_MAX_DIRTY
+#define KIT_MAX_DIRTY 16
+#endif
+
+#ifndef KIT_TEXT_CACHE_SIZE
+#define KIT_TEXT_CACHE_SIZE (256 * 1024)
+#endif
+
+#ifndef KIT_TILE_SIZE
+#define KIT_TILE_SIZE 64
+#endif
+
+#ifndef KIT_CHUNK_TILES
+#define KIT_CHUNK_TILES 16
+#endif
+
+#ifndef KIT_TILEMAP_CACHE_SIZE
+#define KIT_TILEMAP_CACHE_SIZE (8 * 1024 * 1024)
+#endif
+
+#ifndef KIT_SPIN_TIME
+#define KIT_SPIN_TIME 0.002
+#endif
+
+#ifndef KIT_PROFILE_FRAMES
+#define KIT_PROFILE_FRAMES 120
+#endif
 
-#ifdef _MSC_VER
+#if defined(_MSC_VER) && defined(_WIN32)
 #pragma comment(lib, "gdi32.lib")
 #pragma comment(lib, "user32.lib")
 #pragma comment(lib, "winmm.lib")
@@ -29,13 +77,73 @@ enum {
     KIT_FPS30      = (1 << 4),
     KIT_FPS144     = (1 << 5),
     KIT_FPSINF     = (1 << 6),
+    KIT_DEFERRED   = (1 << 7),
+    KIT_RGB565     = (1 << 8),
+    KIT_INDEXED8   = (1 << 9),
+};
+
+// kit_save_image_*() modes
+enum {
+    KIT_SAVE_STORE, // uncompressed deflate, fastest
+    KIT_SAVE_FAST,  // cheap filters, greedy matches, fixed huffman; under 1ms up to ~480x270
+    KIT_SAVE_SMALL, // all filters, lazy chained matches, dynamic huffman
+};
+
+// kit_Asset types
+enum {
+    KIT_ASSET_IMAGE,
+    KIT_ASSET_FONT,
 };
 
+#ifdef _WIN32
+typedef HANDLE kit__Thread;
+typedef HANDLE kit__Sem;
+#else
+typedef pthread_t kit__Thread;
+typedef struct { pthread_mutex_t mtx; pthread_cond_t cond; int count; } kit__Sem;
+#endif
+
 typedef union { struct { uint8_t b, g, r, a; }; uint32_t w; } kit_Color;
 typedef struct { int x, y, w, h; } kit_Rect;
 typedef struct { kit_Color *pixels; int w, h; } kit_Image;
 typedef struct { kit_Rect rect; int xadv; } kit_Glyph;
-typedef struct { kit_Image *image; kit_Glyph glyphs[256]; } kit_Font;
+typedef struct { kit_Image *image; kit_Glyph glyphs[256]; struct kit__TextCache *cache; } kit_Font;
+typedef struct { kit_Image *image; uint32_t *rows; uint16_t *runs; } kit_RleImage;
+
+// one instance of a kit_draw_sprites() batch, drawn 1:1 from `src`. a zero
+// `mul` (as left by an initializer that skips it) draws untinted
+typedef struct {
+    int x, y;
+    kit_Rect src;
+    kit_Color mul, add;
+} kit_Sprite;
+
+// one file of a kit_load_batch(); `result` and `time` are filled in by the
+// time the asset comes back from kit_batch_poll() / kit_batch_wait()
+typedef struct {
+    char *filename;
+    int type;       // KIT_ASSET_IMAGE or KIT_ASSET_FONT
+    void *result;   // kit_Image* or kit_Font*, NULL if loading failed
+    double time;    // seconds spent reading and decoding
+} kit_Asset;
+typedef struct kit__Batch kit_Batch;
+typedef struct kit__Pack kit_Pack;
+typedef struct kit__Atlas kit_Atlas;
+typedef struct kit__Tilemap kit_Tilemap;
+
+// per-frame counters, only recorded when built with KIT_PROFILE
+typedef struct {
+    int draw_calls;            // kit_draw_* calls that reached clipping
+    int64_t fill_pixels;       // rect and line pixels
+    int64_t image_pixels[3];   // image pixels by blend path: plain, mul, mul+add
+    int64_t clipped_pixels;    // area of draw bounds rejected by the clip rect
+    double work_time;          // time between kit_step calls
+    double flush_time;         // replaying deferred draws
+    double present_time;       // expanding and presenting dirty rects
+    double sleep_time;         // waiting for the frame deadline
+    double events_time;        // pumping window messages
+    double frame_time;         // kit_step to kit_step
+} kit_Profile;
 
 typedef struct {
     bool wants_quit;
@@ -49,14 +157,39 @@ typedef struct {
     // time
     double step_time;
     double prev_time;
+    struct { double last, frame_time, jitter; int missed; } frame;
     // graphics
     kit_Rect clip;
     kit_Font *font;
     kit_Image *screen;
+    kit_Rect dirty[KIT_MAX_DIRTY];
+    int dirty_count;
+    // deferred drawing
+    bool deferred;
+    struct { uint8_t *data; int len, cap, count; kit_Rect bounds; } cmds;
+    struct { int x, y, cols, count; volatile long next; } tiles;
+    // worker threads
+    int thread_count;
+    kit__Thread *threads;
+    kit__Sem thread_start, thread_done;
+    bool threads_quit;
+    // reduced-depth framebuffer (KIT_RGB565 / KIT_INDEXED8); draws go to
+    // `fb` and are expanded into `screen` when presented
+    int format;
+    void *fb;
+    kit_Color palette[256];
+    uint8_t *inverse;
+#ifdef KIT_PROFILE
+    // profiler; `frames` is a ring of completed frames ending before `head`
+    struct { kit_Profile cur, frames[KIT_PROFILE_FRAMES]; int head, count; double mark; } prof;
+#endif
+#ifndef KIT_HEADLESS
     // windows
     int win_w, win_h;
+    kit_Image *upscaled;
     HWND hwnd;
     HDC hdc;
+#endif
 } kit_Context;
 
 #define kit_max(a, b) ((a) > (b) ? (a) : (b))
@@ -75,17 +208,53 @@ typedef struct {
 kit_Context* kit_create(const char *title, int w, int h, int flags);
 void kit_destroy(kit_Context *ctx);
 bool kit_step(kit_Context *ctx, double *dt);
-void* kit_read_file(char *filename, int *len);
+void kit_frame_stats(kit_Context *ctx, double *frame_time, double *jitter, int *missed);
+int  kit_profile_frames(kit_Context *ctx, kit_Profile *frames, int max);
+void kit_draw_profile(kit_Context *ctx, int x, int y);
+void* kit_read_file(char *filename, size_t *len);
+void* kit_map_file(char *filename, size_t *len);
+void kit_unmap_file(void *data, size_t len);
 
 kit_Image* kit_create_image(int w, int h);
 kit_Image* kit_load_image_file(char *filename);
 kit_Image* kit_load_image_mem(void *data, int len);
 void kit_destroy_image(kit_Image *img);
+void kit_premultiply_image(kit_Image *img);
+void kit_upscale_image(kit_Image *dst, kit_Image *src, int scale);
+void* kit_save_image_mem(kit_Image *img, int mode, int *len);
+bool kit_save_image_file(kit_Image *img, char *filename, int mode);
+
+kit_RleImage* kit_compile_image(kit_Image *img);
+void kit_destroy_rle_image(kit_RleImage *img);
 
 kit_Font* kit_load_font_file(char *filename);
 kit_Font* kit_load_font_mem(void *data, int len);
 void kit_destroy_font(kit_Font *font);
+
+kit_Batch* kit_load_batch(kit_Asset *assets, int count, int threads);
+kit_Asset* kit_batch_poll(kit_Batch *batch);
+kit_Asset* kit_batch_wait(kit_Batch *batch);
+void kit_batch_stats(kit_Batch *batch, int *finished, int *failed);
+void kit_destroy_batch(kit_Batch *batch);
+kit_Pack* kit_open_pack(char *filename);
+kit_Pack* kit_open_pack_mem(void *data, size_t len);
+void kit_close_pack(kit_Pack *pack);
+kit_Image* kit_pack_image(kit_Pack *pack, char *name);
+kit_Font* kit_pack_font(kit_Pack *pack, char *name);
+kit_Atlas* kit_create_atlas(int w, int h);
+void kit_destroy_atlas(kit_Atlas *atlas);
+kit_Image* kit_atlas_add(kit_Atlas *atlas, kit_Image *img, kit_Rect *rect);
+void kit_atlas_stats(kit_Atlas *atlas, int *pages, double *occupancy);
+kit_Tilemap* kit_create_tilemap(kit_Image *sheet, int tile_w, int tile_h, int w, int h, int layers);
+void kit_destroy_tilemap(kit_Tilemap *map);
+void kit_set_tile(kit_Tilemap *map, int layer, int x, int y, int tile);
+int  kit_get_tile(kit_Tilemap *map, int layer, int x, int y);
+void kit_draw_tilemap(kit_Context *ctx, kit_Tilemap *map, int x, int y);
+void kit_tilemap_stats(kit_Tilemap *map, int *chunks, int *bytes);
 int kit_text_width(kit_Font *font, char *text);
+void kit_set_text_cache(kit_Context *ctx, kit_Font *font, int budget);
+void kit_clear_text_cache(kit_Context *ctx, kit_Font *font);
+void kit_text_cache_stats(kit_Font *font, int *hits, int *misses, int *bytes);
 
 int  kit_get_char(kit_Context *ctx);
 bool kit_key_down(kit_Context *ctx, int key);
@@ -96,15 +265,29 @@ void kit_mouse_delta(kit_Context *ctx, int *x, int *y);
 bool kit_mouse_down(kit_Context *ctx, int button);
 bool kit_mouse_pressed(kit_Context *ctx, int button);
 bool kit_mouse_released(kit_Context *ctx, int button);
+void kit_inject_key(kit_Context *ctx, int key, bool down);
+void kit_inject_char(kit_Context *ctx, int chr);
+void kit_inject_mouse_pos(kit_Context *ctx, int x, int y);
+void kit_inject_mouse_button(kit_Context *ctx, int button, bool down);
+
+void kit_flush(kit_Context *ctx);
+void kit_set_threads(kit_Context *ctx, int n);
+void kit_command_stats(kit_Context *ctx, int *count, int *bytes);
 
 void kit_clear(kit_Context *ctx, kit_Color color);
 void kit_set_clip(kit_Context *ctx, kit_Rect rect);
+void kit_set_palette(kit_Context *ctx, kit_Color *colors, int n);
+void kit_mark_dirty(kit_Context *ctx, kit_Rect rect);
+int  kit_dirty_rects(kit_Context *ctx, kit_Rect *rects, int max);
 void kit_draw_point(kit_Context *ctx, kit_Color color, int x, int y);
 void kit_draw_rect(kit_Context *ctx, kit_Color color, kit_Rect rect);
 void kit_draw_line(kit_Context *ctx, kit_Color color, int x1, int y1, int x2, int y2);
 void kit_draw_image(kit_Context *ctx, kit_Image *img, int x, int y);
 void kit_draw_image2(kit_Context *ctx, kit_Color color, kit_Image *img, int x, int y, kit_Rect src);
 void kit_draw_image3(kit_Context *ctx, kit_Color mul_color, kit_Color add_color, kit_Image *img, kit_Rect dst, kit_Rect src);
+void kit_draw_rle_image(kit_Context *ctx, kit_Color mul_color, kit_Color add_color, kit_RleImage *img, int x, int y, kit_Rect src);
+void kit_draw_sprites(kit_Context *ctx, kit_Image *img, kit_Sprite *sprites, int count);
+void kit_draw_image_affine(kit_Context *ctx, kit_Color mul_color, kit_Color add_color, kit_Image *img, kit_Rect src, float *m);
 int  kit_draw_text(kit_Context *ctx, kit_Color color, char *text, int x, int y);
 int  kit_draw_text2(kit_Context *ctx, kit_Color color, kit_Font *font, char *text, int x, int y);
 
@@ -114,6 +297,20 @@ int  kit_draw_text2(kit_Context *ctx, kit_Color color, kit_Font *font, char *tex
 
 #ifdef KIT_IMPL
 
+// simd kernels are picked at compile time; define KIT_NO_SIMD to force scalar
+#if !defined(KIT_NO_SIMD) && defined(__AVX2__)
+#define KIT__AVX2
+#define KIT__SSSE3
+#include <immintrin.h>
+#elif !defined(KIT_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || _M_IX86_FP >= 2)
+#define KIT__SSE2
+#include <emmintrin.h>
+#if defined(__SSSE3__)
+#define KIT__SSSE3
+#include <tmmintrin.h>
+#endif
+#endif
+
 enum {
     KIT_INPUT_DOWN     = (1 << 0),
     KIT_INPUT_PRESSED  = (1 << 1),
@@ -144,13 +341,6 @@ static bool kit__check_input_flag(uint8_t *t, uint32_t idx, uint32_t cap, int fl
 }
 
 
-static void kit__scale_size_by_flags(int *w, int *h, int flags) {
-    if (flags & KIT_SCALE2X) { *w *= 2; *h *= 2; } else
-    if (flags & KIT_SCALE3X) { *w *= 3; *h *= 3; } else
-    if (flags & KIT_SCALE4X) { *w *= 4; *h *= 4; }
-}
-
-
 static double kit__flags_to_step_time(int flags) {
     if (flags & KIT_FPS30 ) { return 1.0 /  30.0; }
     if (flags & KIT_FPS144) { return 1.0 / 144.0; }
@@ -158,1005 +348,4673 @@ static double kit__flags_to_step_time(int flags) {
     return 1.0 / 60.0;
 }
 
-static double kit__now(void) {
-    return clock() / 1000.0;
-}
 
+//////////////////////////////////////////////////////////////////////////////
+// Platform
+//////////////////////////////////////////////////////////////////////////////
 
-static kit_Rect kit__intersect_rects(kit_Rect a, kit_Rect b) {
-    int x1 = kit_max(a.x, b.x);
-    int y1 = kit_max(a.y, b.y);
-    int x2 = kit_min(a.x + a.w, b.x + b.w);
-    int y2 = kit_min(a.y + a.h, b.y + b.h);
-    return (kit_Rect) { x1, y1, x2 - x1, y2 - y1 };
-}
+// clock, sleep, atomics and threads: win32 on windows, posix elsewhere. the
+// window itself lives further down and is compiled out by KIT_HEADLESS
 
+typedef struct { void (*fn)(void*); void *arg; } kit__ThreadStart;
 
-static inline kit_Color kit__blend_pixel(kit_Color dst, kit_Color src) {
-    kit_Color res;
-    res.w = (dst.w & 0xff00ff) + ((((src.w & 0xff00ff) - (dst.w & 0xff00ff)) * src.a) >> 8);
-    res.g = dst.g + (((src.g - dst.g) * src.a) >> 8);
-    res.a = dst.a;
-    return res;
+static char kit__empty_file[1];
+
+#ifdef _WIN32
+
+static double kit__now(void) {
+    static double freq;
+    if (!freq) {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        freq = f.QuadPart;
+    }
+    LARGE_INTEGER c;
+    QueryPerformanceCounter(&c);
+    return c.QuadPart / freq;
 }
 
+static void kit__sleep(double secs) { Sleep(secs * 1000); }
+static void kit__yield(void) { YieldProcessor(); }
+static long kit__atomic_inc(volatile long *p) { return InterlockedIncrement(p); }
 
-static inline kit_Color kit__blend_pixel2(kit_Color dst, kit_Color src, kit_Color clr) {
-    src.a = (src.a * clr.a) >> 8;
-    int ia = 0xff - src.a;
-    dst.r = ((src.r * clr.r * src.a) >> 16) + ((dst.r * ia) >> 8);
-    dst.g = ((src.g * clr.g * src.a) >> 16) + ((dst.g * ia) >> 8);
-    dst.b = ((src.b * clr.b * src.a) >> 16) + ((dst.b * ia) >> 8);
-    return dst;
+static int kit__cpu_count(void) {
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
 }
 
+static DWORD WINAPI kit__thread_main(LPVOID arg) {
+    kit__ThreadStart start = *(kit__ThreadStart*) arg;
+    free(arg);
+    start.fn(start.arg);
+    return 0;
+}
 
-static inline kit_Color kit__blend_pixel3(kit_Color dst, kit_Color src, kit_Color clr, kit_Color add) {
-  src.r = kit_min(255, src.r + add.r);
-  src.g = kit_min(255, src.g + add.g);
-  src.b = kit_min(255, src.b + add.b);
-  return kit__blend_pixel2(dst, src, clr);
+static void kit__start_thread(kit__Thread *t, void (*fn)(void*), void *arg) {
+    kit__ThreadStart *start = kit__alloc(sizeof(kit__ThreadStart));
+    *start = (kit__ThreadStart) { fn, arg };
+    *t = CreateThread(NULL, 0, kit__thread_main, start, 0, NULL);
+    if (!*t) { kit__panic("could not create thread"); }
 }
 
+static void kit__join_thread(kit__Thread t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
 
-static kit_Rect kit__get_adjusted_window_rect(kit_Context *ctx) {
-    // work out maximum size to retain aspect ratio
-    float src_ar = (float) ctx->screen->h / ctx->screen->w;
-    float dst_ar = (float) ctx->win_h / ctx->win_w;
-    int w, h;
-    if (src_ar < dst_ar) {
-        w = ctx->win_w; h = ceil(w * src_ar);
-    } else {
-        h = ctx->win_h; w = ceil(h / src_ar);
+static void kit__sem_init(kit__Sem *s) { *s = CreateSemaphore(NULL, 0, 0x7fffffff, NULL); }
+static void kit__sem_post(kit__Sem *s, int n) { ReleaseSemaphore(*s, n, NULL); }
+static void kit__sem_wait(kit__Sem *s) { WaitForSingleObject(*s, INFINITE); }
+static void kit__sem_destroy(kit__Sem *s) { CloseHandle(*s); }
+
+static void* kit__map_file(char *filename, size_t *len) {
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) { return NULL; }
+    void *data = NULL;
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && (uint64_t) size.QuadPart <= SIZE_MAX) {
+        *len = size.QuadPart;
+        if (*len == 0) {
+            // empty files can't be mapped
+            data = kit__empty_file;
+        } else {
+            HANDLE map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (map) {
+                data = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(map);
+            }
+        }
     }
-    // return centered rect
-    return kit_rect((ctx->win_w - w) / 2, (ctx->win_h - h) / 2, w, h);
+    CloseHandle(file);
+    return data;
 }
 
+static void kit__unmap_file(void *data, size_t len) {
+    if (len) { UnmapViewOfFile(data); }
+}
 
-static LRESULT CALLBACK kit__wndproc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
-    kit_Context *ctx = (void*) GetProp(hWnd, "kit_Context");
+#else
 
-    switch (message) {
-    case WM_PAINT:;
-        BITMAPINFO bmi = {
-            .bmiHeader.biSize = sizeof(BITMAPINFOHEADER),
-            .bmiHeader.biBitCount = 32,
-            .bmiHeader.biCompression = BI_RGB,
-            .bmiHeader.biPlanes = 1,
-            .bmiHeader.biWidth = ctx->screen->w,
-            .bmiHeader.biHeight = -ctx->screen->h
-        };
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-        kit_Rect wr = kit__get_adjusted_window_rect(ctx);
+static double kit__now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-        StretchDIBits(ctx->hdc,
-            wr.x, wr.y, wr.w, wr.h,
-            0, 0, ctx->screen->w, ctx->screen->h,
-            ctx->screen->pixels, &bmi, DIB_RGB_COLORS, SRCCOPY);
+static void kit__sleep(double secs) {
+    struct timespec ts = { .tv_sec = secs, .tv_nsec = fmod(secs, 1.0) * 1e9 };
+    nanosleep(&ts, NULL);
+}
 
-        ValidateRect(hWnd, 0);
-        break;
+static void kit__yield(void) { sched_yield(); }
+static long kit__atomic_inc(volatile long *p) { return __sync_add_and_fetch(p, 1); }
+static int kit__cpu_count(void) { return sysconf(_SC_NPROCESSORS_ONLN); }
 
-    case WM_SETCURSOR:
-        if (ctx->hide_cursor && LOWORD(lParam) == HTCLIENT) {
-            SetCursor(0);
-            break;
-        }
-        goto unhandled;
+static void* kit__thread_main(void *arg) {
+    kit__ThreadStart start = *(kit__ThreadStart*) arg;
+    free(arg);
+    start.fn(start.arg);
+    return NULL;
+}
 
-    case WM_KEYDOWN:
-    case WM_SYSKEYDOWN:
-        if (lParam & (1 << 30)) { // key repeat
-            break;
-        }
-        ctx->key_state[(uint8_t) wParam] = KIT_INPUT_DOWN | KIT_INPUT_PRESSED;
-        break;
+static void kit__start_thread(kit__Thread *t, void (*fn)(void*), void *arg) {
+    kit__ThreadStart *start = kit__alloc(sizeof(kit__ThreadStart));
+    *start = (kit__ThreadStart) { fn, arg };
+    if (pthread_create(t, NULL, kit__thread_main, start)) { kit__panic("could not create thread"); }
+}
 
-    case WM_KEYUP:
-    case WM_SYSKEYUP:
-        ctx->key_state[(uint8_t) wParam] &= ~KIT_INPUT_DOWN;
-        ctx->key_state[(uint8_t) wParam] |=  KIT_INPUT_RELEASED;
-        break;
+static void kit__join_thread(kit__Thread t) {
+    pthread_join(t, NULL);
+}
 
-    case WM_CHAR:
-        if (wParam < 32) { break; }
-        for (int i = 0; i < kit_lengthof(ctx->char_buf); i++) {
-            if (ctx->char_buf[i]) { continue; }
-            ctx->char_buf[i] = wParam;
-            break;
-        }
-        break;
+// posix semaphores are missing on some systems, so build one
+static void kit__sem_init(kit__Sem *s) {
+    pthread_mutex_init(&s->mtx, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->count = 0;
+}
 
-    case WM_LBUTTONDOWN: case WM_LBUTTONUP:
-    case WM_RBUTTONDOWN: case WM_RBUTTONUP:
-    case WM_MBUTTONDOWN: case WM_MBUTTONUP:;
-        int button = (message == WM_LBUTTONDOWN || message == WM_LBUTTONUP) ? 1 :
-                     (message == WM_RBUTTONDOWN || message == WM_RBUTTONUP) ? 2 : 3;
-        if (message == WM_LBUTTONDOWN || message == WM_RBUTTONDOWN || message == WM_MBUTTONDOWN) {
-            SetCapture(hWnd);
-            ctx->mouse_state[button] = KIT_INPUT_DOWN | KIT_INPUT_PRESSED;
+static void kit__sem_post(kit__Sem *s, int n) {
+    pthread_mutex_lock(&s->mtx);
+    s->count += n;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mtx);
+}
+
+static void kit__sem_wait(kit__Sem *s) {
+    pthread_mutex_lock(&s->mtx);
+    while (s->count == 0) { pthread_cond_wait(&s->cond, &s->mtx); }
+    s->count--;
+    pthread_mutex_unlock(&s->mtx);
+}
+
+static void kit__sem_destroy(kit__Sem *s) {
+    pthread_mutex_destroy(&s->mtx);
+    pthread_cond_destroy(&s->cond);
+}
+
+static void* kit__map_file(char *filename, size_t *len) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) { return NULL; }
+    void *data = NULL;
+    struct stat st;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && (uint64_t) st.st_size <= SIZE_MAX) {
+        *len = st.st_size;
+        if (*len == 0) {
+            // empty files can't be mapped
+            data = kit__empty_file;
         } else {
-            ReleaseCapture();
-            ctx->mouse_state[button] &= ~KIT_INPUT_DOWN;
-            ctx->mouse_state[button] |=  KIT_INPUT_RELEASED;
+            data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) { data = NULL; }
         }
-        // fallthrough
+    }
+    close(fd);
+    return data;
+}
 
-    case WM_MOUSEMOVE:;
-        wr = kit__get_adjusted_window_rect(ctx);
-        int prevx = ctx->mouse_pos.x;
-        int prevy = ctx->mouse_pos.y;
-        ctx->mouse_pos.x = (GET_X_LPARAM(lParam) - wr.x) * ctx->screen->w / wr.w;
-        ctx->mouse_pos.y = (GET_Y_LPARAM(lParam) - wr.y) * ctx->screen->h / wr.h;
-        ctx->mouse_delta.x += ctx->mouse_pos.x - prevx;
-        ctx->mouse_delta.y += ctx->mouse_pos.y - prevy;
-        break;
+static void kit__unmap_file(void *data, size_t len) {
+    if (len) { munmap(data, len); }
+}
 
-    case WM_SIZE:
-        if (wParam != SIZE_MINIMIZED) {
-            // set size
-            ctx->win_w = LOWORD(lParam);
-            ctx->win_h = HIWORD(lParam);
-            // paint window black
-            PAINTSTRUCT ps;
-            HDC hdc = BeginPaint(hWnd, &ps);
-            HBRUSH brush = CreateSolidBrush(RGB(0, 0, 0));
-            FillRect(hdc, &ps.rcPaint, brush);
-            DeleteObject(brush);
-            EndPaint(hWnd, &ps);
-            // redraw
-            RedrawWindow(ctx->hwnd, 0, 0, RDW_INVALIDATE | RDW_UPDATENOW);
-        }
-        break;
+#endif
 
-    case WM_QUIT:
-    case WM_CLOSE:
-        ctx->wants_quit = true;
-        break;
+// profiling hooks; these expand to nothing unless KIT_PROFILE is defined
+#ifdef KIT_PROFILE
+#define KIT__PROF_COUNT(ctx, field, n) ((ctx)->prof.cur.field += (n))
+#define KIT__PROF_BEGIN(t)             double t = kit__now()
+#define KIT__PROF_END(ctx, field, t)   ((ctx)->prof.cur.field += kit__now() - (t))
+#define KIT__PROF_FRAME(ctx)           kit__end_profile_frame(ctx)
+#else
+#define KIT__PROF_COUNT(ctx, field, n) ((void) 0)
+#define KIT__PROF_BEGIN(t)
+#define KIT__PROF_END(ctx, field, t)   ((void) 0)
+#define KIT__PROF_FRAME(ctx)           ((void) 0)
+#endif
 
-    default:
-unhandled:
-        return DefWindowProc(hWnd, message, wParam, lParam);
-    }
 
-    return 0;
+// sleeping only resolves to about a millisecond, so sleep until the last
+// KIT_SPIN_TIME seconds before `deadline` and spin through the rest
+static void kit__wait_until(double deadline) {
+    for (;;) {
+        double left = deadline - kit__now();
+        if (left <= 0) { return; }
+        if (left > KIT_SPIN_TIME) {
+            kit__sleep(left - KIT_SPIN_TIME);
+        } else {
+            kit__yield();
+        }
+    }
 }
 
 
-static void *kit__font_png_data;
-static int   kit__font_png_size;
+static kit_Rect kit__intersect_rects(kit_Rect a, kit_Rect b) {
+    int x1 = kit_max(a.x, b.x);
+    int y1 = kit_max(a.y, b.y);
+    int x2 = kit_min(a.x + a.w, b.x + b.w);
+    int y2 = kit_min(a.y + a.h, b.y + b.h);
+    return (kit_Rect) { x1, y1, x2 - x1, y2 - y1 };
+}
 
-kit_Context* kit_create(const char *title, int w, int h, int flags) {
-    kit_Context *ctx = kit__alloc(sizeof(kit_Context));
 
-    ctx->screen = kit_create_image(w, h);
-    ctx->step_time = kit__flags_to_step_time(flags);
-    ctx->hide_cursor = !!(flags & KIT_HIDECURSOR);
-    ctx->clip = kit_rect(0, 0, w, h);
+static kit_Rect kit__merge_rects(kit_Rect a, kit_Rect b) {
+    int x1 = kit_min(a.x, b.x);
+    int y1 = kit_min(a.y, b.y);
+    int x2 = kit_max(a.x + a.w, b.x + b.w);
+    int y2 = kit_max(a.y + a.h, b.y + b.h);
+    return (kit_Rect) { x1, y1, x2 - x1, y2 - y1 };
+}
 
-    RegisterClass(&(WNDCLASS) {
-        .style = CS_OWNDC | CS_HREDRAW | CS_VREDRAW,
-        .lpfnWndProc = kit__wndproc,
-        .hCursor = LoadCursor(0, IDC_ARROW),
-        .lpszClassName = title,
-        .hIcon = LoadIcon(GetModuleHandle(0), "icon"),
-    });
 
-    kit__scale_size_by_flags(&w, &h, flags);
-    RECT rect = { .right = w, .bottom = h };
-    int style = WS_OVERLAPPEDWINDOW;
-    AdjustWindowRect(&rect, style, 0);
-    ctx->hwnd = CreateWindow(
-        title, title, style,
-        CW_USEDEFAULT, CW_USEDEFAULT,
-        rect.right - rect.left, rect.bottom - rect.top,
-        0, 0, 0, 0
-    );
-    SetProp(ctx->hwnd, "kit_Context", ctx);
+static void kit__add_dirty(kit_Context *ctx, kit_Rect r) {
+    if (r.w <= 0 || r.h <= 0) { return; }
 
-    ShowWindow(ctx->hwnd, SW_NORMAL);
-    ctx->hdc = GetDC(ctx->hwnd);
+    // merge with every rect this one overlaps or touches
+    for (int i = 0; i < ctx->dirty_count; i++) {
+        kit_Rect d = ctx->dirty[i];
+        if (r.x <= d.x + d.w && d.x <= r.x + r.w && r.y <= d.y + d.h && d.y <= r.y + r.h) {
+            r = kit__merge_rects(r, d);
+            ctx->dirty[i] = ctx->dirty[--ctx->dirty_count];
+            i = -1;
+        }
+    }
 
-    timeBeginPeriod(1);
+    // list is full: fold into whichever rect grows the least and retry
+    if (ctx->dirty_count == KIT_MAX_DIRTY) {
+        int best = 0, best_cost = INT32_MAX;
+        for (int i = 0; i < ctx->dirty_count; i++) {
+            kit_Rect m = kit__merge_rects(r, ctx->dirty[i]);
+            int cost = m.w * m.h - ctx->dirty[i].w * ctx->dirty[i].h;
+            if (cost < best_cost) { best = i; best_cost = cost; }
+        }
+        r = kit__merge_rects(r, ctx->dirty[best]);
+        ctx->dirty[best] = ctx->dirty[--ctx->dirty_count];
+        kit__add_dirty(ctx, r);
+        return;
+    }
 
-    ctx->font = kit_load_font_mem(kit__font_png_data, kit__font_png_size);
-    ctx->prev_time = kit__now();
+    ctx->dirty[ctx->dirty_count++] = r;
+}
 
-    return ctx;
+
+// api colors are straight alpha; these convert to and from image pixels,
+// and are no-ops unless KIT_PREMULTIPLIED is defined
+static inline kit_Color kit__premultiply(kit_Color c) {
+#ifdef KIT_PREMULTIPLIED
+    int a = c.a + 1;
+    c.r = (c.r * a) >> 8;
+    c.g = (c.g * a) >> 8;
+    c.b = (c.b * a) >> 8;
+#endif
+    return c;
 }
 
 
-void kit_destroy(kit_Context *ctx) {
-    ReleaseDC(ctx->hwnd, ctx->hdc);
-    DestroyWindow(ctx->hwnd);
-    kit_destroy_image(ctx->screen);
-    kit_destroy_font(ctx->font);
-    free(ctx);
+static inline kit_Color kit__unpremultiply(kit_Color c) {
+#ifdef KIT_PREMULTIPLIED
+    if (c.a == 0) { return (kit_Color) {0}; }
+    c.r = kit_min(255, (c.r * 255 + c.a / 2) / c.a);
+    c.g = kit_min(255, (c.g * 255 + c.a / 2) / c.a);
+    c.b = kit_min(255, (c.b * 255 + c.a / 2) / c.a);
+#endif
+    return c;
 }
 
 
-int kit_text_width(kit_Font *font, char *text) {
-    int x = 0;
-    for (uint8_t *p = (void*) text; *p; p++) {
-        x += font->glyphs[*p].xadv;
+static void kit__premultiply_row(kit_Color *p, int n) {
+#ifdef KIT_PREMULTIPLIED
+    for (int i = 0; i < n; i++) {
+        if (p[i].a != 0xff) { p[i] = kit__premultiply(p[i]); }
     }
-    return x;
+#endif
 }
 
 
-bool kit_step(kit_Context *ctx, double *dt) {
-    // present
-    RedrawWindow(ctx->hwnd, 0, 0, RDW_INVALIDATE | RDW_UPDATENOW);
+#ifdef KIT_PREMULTIPLIED
 
-    // handle delta time / wait for next frame
-    double now = kit__now();
-    double wait = (ctx->prev_time + ctx->step_time) - now;
-    double prev = ctx->prev_time;
-    if (wait > 0) {
-        Sleep(wait * 1000);
-        ctx->prev_time += ctx->step_time;
-    } else {
-        ctx->prev_time = now;
-    }
-    if (dt) { *dt = ctx->prev_time - prev; }
+// dst * (1 - a) + src, with 256 - a so that a = 0 keeps dst exactly. red and
+// blue share one multiply; their products can't carry into each other
+static inline kit_Color kit__blend_pixel(kit_Color dst, kit_Color src) {
+    int ia = 0x100 - src.a;
+    kit_Color res;
+    res.w = ((((dst.w & 0xff00ff) * ia) >> 8) & 0xff00ff) + (src.w & 0xff00ff);
+    res.g = ((dst.g * ia) >> 8) + src.g;
+    res.a = dst.a;
+    return res;
+}
 
-    // reset input state
-    memset(ctx->char_buf, 0, sizeof(ctx->char_buf));
-    for (int i = 0; i < sizeof(ctx->key_state); i++) {
-        ctx->key_state[i] &= ~(KIT_INPUT_PRESSED | KIT_INPUT_RELEASED);
-    }
-    for (int i = 0; i < sizeof(ctx->mouse_state); i++) {
-        ctx->mouse_state[i] &= ~(KIT_INPUT_PRESSED | KIT_INPUT_RELEASED);
-    }
-    memset(&ctx->mouse_delta, 0, sizeof(ctx->mouse_delta));
-
-    // handle events
-    MSG msg;
-    while (PeekMessage(&msg, ctx->hwnd, 0, 0, PM_REMOVE)) {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
-    }
-    return !ctx->wants_quit;
-}
 
+#if defined(KIT__SSE2) || defined(KIT__AVX2)
 
-void* kit_read_file(char *filename, int *len) {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) { return NULL; }
-    fseek(fp, 0, SEEK_END);
-    int n = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    char *buf = kit__alloc(n + 1);
-    fread(buf, 1, n, fp);
-    fclose(fp);
-    if (len) { *len = n; }
-    return buf;
+// the tinted paths work on one pixel in 16-bit lanes, b g r a
+static inline __m128i kit__unpack_pixel(kit_Color c) {
+    return _mm_unpacklo_epi8(_mm_cvtsi32_si128(c.w), _mm_setzero_si128());
 }
 
 
-kit_Image* kit_create_image(int w, int h) {
-    kit__expect(w > 0 && h > 0);
-    kit_Image *img = kit__alloc(sizeof(kit_Image) + w * h * sizeof(kit_Color));
-    img->pixels = (void*) (img + 1);
-    img->w = w;
-    img->h = h;
-    return img;
+// `s` is premultiplied; the same math as kit__blend_pixel()
+static inline kit_Color kit__blend_unpacked(kit_Color dst, __m128i s) {
+    __m128i rgb = _mm_set_epi16(0, 0, 0, 0, 0, -1, -1, -1);
+    __m128i a = _mm_and_si128(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), rgb);
+    __m128i d = _mm_mullo_epi16(kit__unpack_pixel(dst), _mm_sub_epi16(_mm_set1_epi16(0x100), a));
+    d = _mm_add_epi16(_mm_srli_epi16(d, 8), _mm_and_si128(s, rgb));
+    return (kit_Color) { .w = _mm_cvtsi128_si32(_mm_packus_epi16(d, d)) };
 }
 
 
-kit_Image* kit_load_image_file(char *filename) {
-    int len;
-    void *data = kit_read_file(filename, &len);
-    if (!data) { return NULL; }
-    kit_Image *res = kit_load_image_mem(data, len);
-    free(data);
-    return res;
+// `clr` is premultiplied too, so tinting is one multiply per channel
+static inline kit_Color kit__blend_pixel2(kit_Color dst, kit_Color src, kit_Color clr) {
+    __m128i m = _mm_add_epi16(kit__unpack_pixel(clr), _mm_set1_epi16(1));
+    __m128i s = _mm_srli_epi16(_mm_mullo_epi16(kit__unpack_pixel(src), m), 8);
+    return kit__blend_unpacked(dst, s);
 }
 
 
-static kit_Image* kit__load_png(void *data, int len);
-
-kit_Image* kit_load_image_mem(void *data, int len) {
-    return kit__load_png(data, len);
+// the straight color is clamped to 255 after adding, so the premultiplied
+// one is clamped to alpha
+static inline kit_Color kit__blend_pixel3(kit_Color dst, kit_Color src, kit_Color clr, kit_Color add) {
+    __m128i s = kit__unpack_pixel(src);
+    __m128i a = _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3));
+    add.a = 0;
+    __m128i d = _mm_srli_epi16(_mm_mullo_epi16(kit__unpack_pixel(add), _mm_add_epi16(a, _mm_set1_epi16(1))), 8);
+    s = _mm_min_epi16(_mm_add_epi16(s, d), a);
+    __m128i m = _mm_add_epi16(kit__unpack_pixel(clr), _mm_set1_epi16(1));
+    return kit__blend_unpacked(dst, _mm_srli_epi16(_mm_mullo_epi16(s, m), 8));
 }
 
+#else
 
-void kit_destroy_image(kit_Image *img) {
-    free(img);
+static inline kit_Color kit__blend_pixel2(kit_Color dst, kit_Color src, kit_Color clr) {
+    src.r = (src.r * (clr.r + 1)) >> 8;
+    src.g = (src.g * (clr.g + 1)) >> 8;
+    src.b = (src.b * (clr.b + 1)) >> 8;
+    src.a = (src.a * (clr.a + 1)) >> 8;
+    return kit__blend_pixel(dst, src);
 }
 
 
-static bool kit__check_column(kit_Image *img, int x, int y, int h) {
-    while (h > 0) {
-        if (img->pixels[x + y * img->w].a) {
-            return true;
-        }
-        y++; h--;
-    }
-    return false;
+static inline kit_Color kit__blend_pixel3(kit_Color dst, kit_Color src, kit_Color clr, kit_Color add) {
+    int a = src.a + 1;
+    src.r = kit_min(src.a, src.r + ((add.r * a) >> 8));
+    src.g = kit_min(src.a, src.g + ((add.g * a) >> 8));
+    src.b = kit_min(src.a, src.b + ((add.b * a) >> 8));
+    return kit__blend_pixel2(dst, src, clr);
 }
 
+#endif
 
-static kit_Font* kit__load_font_from_image(kit_Image *img) {
-    if (!img) { return NULL; }
-    kit_Font *font = kit__alloc(sizeof(kit_Font));
-    font->image = img;
+#else
 
-    // init glyphs
-    for (int i = 0; i < 256; i++) {
-        kit_Glyph *g = &font->glyphs[i];
-        kit_Rect r = {
-            (img->w / 16) * (i % 16),
-            (img->h / 16) * (i / 16),
-            img->w / 16,
-            img->h / 16
-        };
-        // right-trim rect
-        for (int x = r.x + r.w - 1; x >= r.x; x--) {
-            if (kit__check_column(font->image, x, r.y, r.h)) { break; }
-            r.w--;
-        }
-        // left-trim rect
-        for (int x = r.x; x < r.x + r.w; x++) {
-            if (kit__check_column(font->image, x, r.y, r.h)) { break; }
-            r.x++;
-            r.w--;
-        }
-        // set xadvance and rect
-        g->xadv = r.w + 1;
-        g->rect = r;
-    }
+static inline kit_Color kit__blend_pixel(kit_Color dst, kit_Color src) {
+    kit_Color res;
+    res.w = (dst.w & 0xff00ff) + ((((src.w & 0xff00ff) - (dst.w & 0xff00ff)) * src.a) >> 8);
+    res.g = dst.g + (((src.g - dst.g) * src.a) >> 8);
+    res.a = dst.a;
+    return res;
+}
 
-    font->glyphs[' '].rect = (kit_Rect) {0};
-    font->glyphs[' '].xadv = font->glyphs['a'].xadv;
 
-    return font;
+static inline kit_Color kit__blend_pixel2(kit_Color dst, kit_Color src, kit_Color clr) {
+    src.a = (src.a * clr.a) >> 8;
+    int ia = 0xff - src.a;
+    dst.r = ((src.r * clr.r * src.a) >> 16) + ((dst.r * ia) >> 8);
+    dst.g = ((src.g * clr.g * src.a) >> 16) + ((dst.g * ia) >> 8);
+    dst.b = ((src.b * clr.b * src.a) >> 16) + ((dst.b * ia) >> 8);
+    return dst;
 }
 
 
-kit_Font* kit_load_font_file(char *filename) {
-    return kit__load_font_from_image(kit_load_image_file(filename));
+static inline kit_Color kit__blend_pixel3(kit_Color dst, kit_Color src, kit_Color clr, kit_Color add) {
+  src.r = kit_min(255, src.r + add.r);
+  src.g = kit_min(255, src.g + add.g);
+  src.b = kit_min(255, src.b + add.b);
+  return kit__blend_pixel2(dst, src, clr);
 }
 
+#endif
 
-kit_Font* kit_load_font_mem(void *data, int len) {
-    return kit__load_font_from_image(kit_load_image_mem(data, len));
-}
 
+//////////////////////////////////////////////////////////////////////////////
+// Span kernels
+//////////////////////////////////////////////////////////////////////////////
 
-void kit_destroy_font(kit_Font *font) {
-    free(font->image);
-    free(font);
-}
+// the vector blends reproduce kit__blend_pixel() bit for bit. premultiplied
+// ones work in 16-bit lanes, where the alpha lane gets factor 256 and no
+// source so dst alpha is kept. straight ones blend red/blue packed in 32 bits
+// (wrapping exactly as the scalar code does) and green only needs the low 16
+// bits of its product
 
+#if defined(KIT_PREMULTIPLIED) && defined(KIT__SSE2)
 
-int kit_get_char(kit_Context *ctx) {
-    for (int i = 0; i < kit_lengthof(ctx->char_buf); i++) {
-        if (!ctx->char_buf[i]) { continue; }
-        int res = ctx->char_buf[i];
-        ctx->char_buf[i] = 0;
-        return res;
-    }
-    return 0;
+static inline __m128i kit__blend4(__m128i d, __m128i s, __m128i ia) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ia), 8);
+    __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ia), 8);
+    return _mm_add_epi8(_mm_packus_epi16(lo, hi), s);
 }
 
+#elif defined(KIT_PREMULTIPLIED) && defined(KIT__AVX2)
 
-bool kit_key_down(kit_Context *ctx, int key) {
-    return kit__check_input_flag(ctx->key_state, key, sizeof(ctx->key_state), KIT_INPUT_DOWN);
+static inline __m256i kit__blend8(__m256i d, __m256i s, __m256i ia) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), ia), 8);
+    __m256i hi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), ia), 8);
+    return _mm256_add_epi8(_mm256_packus_epi16(lo, hi), s);
 }
 
+#elif defined(KIT__SSE2)
+
+static inline __m128i kit__blend4(__m128i d, __m128i srb, __m128i sg, __m128i a) {
+    __m128i drb = _mm_and_si128(d, _mm_set1_epi32(0xff00ff));
+    __m128i dg  = _mm_and_si128(_mm_srli_epi32(d, 8), _mm_set1_epi32(0xff));
+    // sse2 has no 32-bit mullo, so do lanes 0,2 and 1,3 separately
+    __m128i x  = _mm_sub_epi32(srb, drb);
+    __m128i p0 = _mm_mul_epu32(x, a);
+    __m128i p1 = _mm_mul_epu32(_mm_srli_si128(x, 4), a);
+    __m128i p  = _mm_unpacklo_epi32(
+        _mm_shuffle_epi32(p0, _MM_SHUFFLE(0, 0, 2, 0)),
+        _mm_shuffle_epi32(p1, _MM_SHUFFLE(0, 0, 2, 0)));
+    __m128i rb = _mm_add_epi32(drb, _mm_srli_epi32(p, 8));
+    __m128i g  = _mm_add_epi32(dg, _mm_srli_epi32(_mm_mullo_epi16(_mm_sub_epi32(sg, dg), a), 8));
+    rb = _mm_and_si128(rb, _mm_set1_epi32(0xff00ff));
+    g = _mm_slli_epi32(_mm_and_si128(g, _mm_set1_epi32(0xff)), 8);
+    d = _mm_and_si128(d, _mm_set1_epi32(0xff000000));
+    return _mm_or_si128(_mm_or_si128(rb, g), d);
+}
 
-bool kit_key_pressed(kit_Context *ctx, int key) {
-    return kit__check_input_flag(ctx->key_state, key, sizeof(ctx->key_state), KIT_INPUT_PRESSED);
+#elif defined(KIT__AVX2)
+
+static inline __m256i kit__blend8(__m256i d, __m256i srb, __m256i sg, __m256i a) {
+    __m256i drb = _mm256_and_si256(d, _mm256_set1_epi32(0xff00ff));
+    __m256i dg  = _mm256_and_si256(_mm256_srli_epi32(d, 8), _mm256_set1_epi32(0xff));
+    __m256i rb  = _mm256_mullo_epi32(_mm256_sub_epi32(srb, drb), a);
+    __m256i g   = _mm256_mullo_epi16(_mm256_sub_epi32(sg, dg), a);
+    rb = _mm256_add_epi32(drb, _mm256_srli_epi32(rb, 8));
+    g = _mm256_add_epi32(dg, _mm256_srli_epi32(g, 8));
+    rb = _mm256_and_si256(rb, _mm256_set1_epi32(0xff00ff));
+    g = _mm256_slli_epi32(_mm256_and_si256(g, _mm256_set1_epi32(0xff)), 8);
+    d = _mm256_and_si256(d, _mm256_set1_epi32(0xff000000));
+    return _mm256_or_si256(_mm256_or_si256(rb, g), d);
 }
 
+#endif
 
-bool kit_key_released(kit_Context *ctx, int key) {
-    return kit__check_input_flag(ctx->key_state, key, sizeof(ctx->key_state), KIT_INPUT_RELEASED);
-}
 
+// spans take the context so reduced-depth targets can reach their palette
+typedef void (*kit__FillSpan)(kit_Context *ctx, void *d, int n, kit_Color color);
+typedef void (*kit__BlitSpan)(kit_Context *ctx, void *d, kit_Color *srow, int n, int sx, int stepx, kit_Color mul_color, kit_Color add_color);
 
-void kit_mouse_pos(kit_Context *ctx, int *x, int *y) {
-    if (x) { *x = ctx->mouse_pos.x; }
-    if (y) { *y = ctx->mouse_pos.y; }
+static void kit__fill_span_rgba(kit_Context *ctx, void *dst, int n, kit_Color color) {
+    kit_Color *d = dst;
+#if defined(KIT__AVX2)
+    __m256i c = _mm256_set1_epi32(color.w);
+    for (; n >= 8; n -= 8, d += 8) { _mm256_storeu_si256((__m256i*) d, c); }
+#elif defined(KIT__SSE2)
+    __m128i c = _mm_set1_epi32(color.w);
+    for (; n >= 4; n -= 4, d += 4) { _mm_storeu_si128((__m128i*) d, c); }
+#endif
+    while (n--) { *d++ = color; }
 }
 
 
-void kit_mouse_delta(kit_Context *ctx, int *x, int *y) {
-    if (x) { *x = ctx->mouse_delta.x; }
-    if (y) { *y = ctx->mouse_delta.y; }
+static void kit__blend_span_rgba(kit_Context *ctx, void *dst, int n, kit_Color color) {
+    kit_Color *d = dst;
+#if defined(KIT_PREMULTIPLIED) && (defined(KIT__SSE2) || defined(KIT__AVX2))
+    // 16-bit factors b, g, r, a for one pixel
+    int64_t f = 0x100 - color.a;
+    f = f | (f << 16) | (f << 32) | ((int64_t) 0x100 << 48);
+#endif
+#if defined(KIT_PREMULTIPLIED) && defined(KIT__AVX2)
+    __m256i s  = _mm256_set1_epi32(color.w & 0xffffff);
+    __m256i ia = _mm256_set1_epi64x(f);
+    for (; n >= 8; n -= 8, d += 8) {
+        __m256i v = _mm256_loadu_si256((__m256i*) d);
+        _mm256_storeu_si256((__m256i*) d, kit__blend8(v, s, ia));
+    }
+#elif defined(KIT_PREMULTIPLIED) && defined(KIT__SSE2)
+    __m128i s  = _mm_set1_epi32(color.w & 0xffffff);
+    __m128i ia = _mm_set1_epi64x(f);
+    for (; n >= 4; n -= 4, d += 4) {
+        __m128i v = _mm_loadu_si128((__m128i*) d);
+        _mm_storeu_si128((__m128i*) d, kit__blend4(v, s, ia));
+    }
+#elif defined(KIT__AVX2)
+    __m256i srb = _mm256_set1_epi32(color.w & 0xff00ff);
+    __m256i sg  = _mm256_set1_epi32(color.g);
+    __m256i a   = _mm256_set1_epi32(color.a);
+    for (; n >= 8; n -= 8, d += 8) {
+        __m256i v = _mm256_loadu_si256((__m256i*) d);
+        _mm256_storeu_si256((__m256i*) d, kit__blend8(v, srb, sg, a));
+    }
+#elif defined(KIT__SSE2)
+    __m128i srb = _mm_set1_epi32(color.w & 0xff00ff);
+    __m128i sg  = _mm_set1_epi32(color.g);
+    __m128i a   = _mm_set1_epi32(color.a);
+    for (; n >= 4; n -= 4, d += 4) {
+        __m128i v = _mm_loadu_si128((__m128i*) d);
+        _mm_storeu_si128((__m128i*) d, kit__blend4(v, srb, sg, a));
+    }
+#endif
+    for (; n > 0; n--, d++) { *d = kit__blend_pixel(*d, color); }
 }
 
 
-bool kit_mouse_down(kit_Context *ctx, int button) {
-    return kit__check_input_flag(ctx->mouse_state, button, sizeof(ctx->mouse_state), KIT_INPUT_DOWN);
+// reduced-depth pixels are unpacked, blended with the 32-bit math and packed
+// again. an rgb565 pixel unpacks to the OR of one lookup per byte; palette
+// indices are found through a 15-bit rgb -> nearest index table
+enum { KIT__FMT_RGBA, KIT__FMT_RGB565, KIT__FMT_INDEXED };
+
+static const int kit__format_bpp[] = { 4, 2, 1 };
+static uint32_t kit__rgb565_lo[256], kit__rgb565_hi[256];
+
+static void kit__init_rgb565(void) {
+    for (int i = 0; i < 256; i++) {
+        int b = i & 31, glo = i >> 5; // low byte:  gggbbbbb
+        int r = i >> 3, ghi = i & 7;  // high byte: rrrrrggg
+        kit__rgb565_lo[i] = ((b << 3) | (b >> 2)) | ((glo << 2) << 8);
+        kit__rgb565_hi[i] = 0xff000000 | (((r << 3) | (r >> 2)) << 16) | (((ghi << 5) | (ghi >> 1)) << 8);
+    }
 }
 
 
-bool kit_mouse_pressed(kit_Context *ctx, int button) {
-    return kit__check_input_flag(ctx->mouse_state, button, sizeof(ctx->mouse_state), KIT_INPUT_PRESSED);
+static inline kit_Color kit__load_rgb565(uint16_t p) {
+    return (kit_Color) { .w = kit__rgb565_lo[p & 0xff] | kit__rgb565_hi[p >> 8] };
 }
 
 
-bool kit_mouse_released(kit_Context *ctx, int button) {
-    return kit__check_input_flag(ctx->mouse_state, button, sizeof(ctx->mouse_state), KIT_INPUT_RELEASED);
+static inline uint16_t kit__pack_rgb565(kit_Color c) {
+    return ((c.r >> 3) << 11) | ((c.g >> 2) << 5) | (c.b >> 3);
 }
 
 
-void kit_clear(kit_Context *ctx, kit_Color color) {
-    kit_draw_rect(ctx, color, KIT_BIG_RECT);
+static inline uint8_t kit__pack_index(kit_Context *ctx, kit_Color c) {
+    return ctx->inverse[((c.r >> 3) << 10) | ((c.g >> 3) << 5) | (c.b >> 3)];
 }
 
 
-void kit_set_clip(kit_Context *ctx, kit_Rect rect) {
-    kit_Rect screen_rect = kit_rect(0, 0, ctx->screen->w, ctx->screen->h);
-    ctx->clip = kit__intersect_rects(rect, screen_rect);
+static inline void* kit__pixel_addr(kit_Context *ctx, int x, int y) {
+    int i = x + y * ctx->screen->w;
+    switch (ctx->format) {
+    case KIT__FMT_RGB565:  return (uint16_t*) ctx->fb + i;
+    case KIT__FMT_INDEXED: return (uint8_t*) ctx->fb + i;
+    }
+    return &ctx->screen->pixels[i];
 }
 
 
-void kit_draw_point(kit_Context *ctx, kit_Color color, int x, int y) {
-    if (color.a == 0) { return; }
-    kit_Rect r = ctx->clip;
-    if (x < r.x || y < r.y || x >= r.x + r.w || y >= r.y + r.h ) {
-        return;
+// unpacks a reduced-depth framebuffer rect into ctx->screen for presenting
+static void kit__expand_rect(kit_Context *ctx, kit_Rect r) {
+    for (int y = r.y; y < r.y + r.h; y++) {
+        kit_Color *d = &ctx->screen->pixels[r.x + y * ctx->screen->w];
+        if (ctx->format == KIT__FMT_RGB565) {
+            uint16_t *s = kit__pixel_addr(ctx, r.x, y);
+            for (int x = 0; x < r.w; x++) { d[x] = kit__load_rgb565(s[x]); }
+        } else {
+            uint8_t *s = kit__pixel_addr(ctx, r.x, y);
+            for (int x = 0; x < r.w; x++) { d[x] = ctx->palette[s[x]]; }
+        }
     }
-    kit_Color *dst = &ctx->screen->pixels[x + y * ctx->screen->w];
-    *dst = kit__blend_pixel(*dst, color);
 }
 
 
-void kit_draw_rect(kit_Context *ctx, kit_Color color, kit_Rect rect) {
-    if (color.a == 0) { return; }
-    rect = kit__intersect_rects(rect, ctx->clip);
-    kit_Color *d = &ctx->screen->pixels[rect.x + rect.y * ctx->screen->w];
-    int dr = ctx->screen->w - rect.w;
-    for (int y = 0; y < rect.h; y++) {
-        for (int x = 0; x < rect.w; x++) {
-            *d = kit__blend_pixel(*d, color);
-            d++;
+// integer nearest-neighbour upscale of `src` rect `r` into `dst` at `scale`x.
+// each source row is widened once and the remaining scale-1 rows are copies
+static void kit__upscale_rect(kit_Image *dst, kit_Image *src, kit_Rect r, int scale) {
+    for (int y = r.y; y < r.y + r.h; y++) {
+        kit_Color *s = &src->pixels[r.x + y * src->w];
+        kit_Color *row = &dst->pixels[r.x * scale + y * scale * dst->w];
+        kit_Color *d = row;
+        int n = r.w;
+#if defined(KIT__SSE2) || defined(KIT__AVX2)
+        if (scale == 2) {
+            for (; n >= 4; n -= 4, s += 4, d += 8) {
+                __m128i v = _mm_loadu_si128((__m128i*) s);
+                _mm_storeu_si128((__m128i*) d,     _mm_unpacklo_epi32(v, v));
+                _mm_storeu_si128((__m128i*) d + 1, _mm_unpackhi_epi32(v, v));
+            }
+        } else if (scale == 3) {
+            for (; n >= 4; n -= 4, s += 4, d += 12) {
+                __m128i v = _mm_loadu_si128((__m128i*) s);
+                _mm_storeu_si128((__m128i*) d,     _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+                _mm_storeu_si128((__m128i*) d + 1, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+                _mm_storeu_si128((__m128i*) d + 2, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+            }
+        } else if (scale >= 4) {
+            for (; n > 0; n--, s++) {
+                __m128i v = _mm_set1_epi32(s->w);
+                int k = scale;
+                for (; k >= 4; k -= 4, d += 4) { _mm_storeu_si128((__m128i*) d, v); }
+                while (k--) { *d++ = *s; }
+            }
+        }
+#endif
+        for (; n > 0; n--, s++) {
+            for (int k = 0; k < scale; k++) { *d++ = *s; }
+        }
+        for (int k = 1; k < scale; k++) {
+            memcpy(row + k * dst->w, row, r.w * scale * sizeof(*row));
         }
-        d += dr;
     }
 }
 
 
-void kit_draw_line(kit_Context *ctx, kit_Color color, int x1, int y1, int x2, int y2) {
-    int dx = abs(x2-x1);
-    int sx = x1 < x2 ? 1 : -1;
-    int dy = -abs(y2 - y1);
-    int sy = y1 < y2 ? 1 : -1;
-    int err = dx + dy;
-    for (;;) {
-        kit_draw_point(ctx, color, x1, y1);
-        if (x1 == x2 && y1 == y2) { break; }
-        int e2 = err << 1;
-        if (e2 >= dy) { err += dy; x1 += sx; }
-        if (e2 <= dx) { err += dx; y1 += sy; }
+// image spans: `sx` and `stepx` are 10-bit fixed point when scaled and whole
+// texels otherwise. plain spans copy opaque texels; all spans skip
+// transparent ones. the bodies are instantiated once per pixel type with
+// KIT__LOAD / KIT__STORE redefined in between
+#define KIT__OP_PLAIN(d, s)  if (s.a == 0xff) { KIT__STORE(d, s); } else if (s.a) { KIT__STORE(d, kit__blend_pixel(KIT__LOAD(d), s)); }
+#define KIT__OP_MUL(d, s)    if (s.a) { KIT__STORE(d, kit__blend_pixel2(KIT__LOAD(d), s, mul_color)); }
+#define KIT__OP_MULADD(d, s) if (s.a) { KIT__STORE(d, kit__blend_pixel3(KIT__LOAD(d), s, mul_color, add_color)); }
+
+#define KIT__BLIT_SPAN(name, T, shift, op)                                       \
+    static void name(kit_Context *ctx, void *dst, kit_Color *srow, int n,        \
+                     int sx, int stepx, kit_Color mul_color, kit_Color add_color) { \
+        T *d = dst;                                                              \
+        for (; n > 0; n--, d++, sx += stepx) {                                   \
+            kit_Color s = srow[sx >> shift];                                     \
+            op(d, s);                                                            \
+        }                                                                        \
+    }
+
+#define KIT__BLIT_SPANS(fmt, T)                                                  \
+    KIT__BLIT_SPAN(kit__blit_plain_##fmt,         T,  0, KIT__OP_PLAIN)          \
+    KIT__BLIT_SPAN(kit__blit_mul_##fmt,           T,  0, KIT__OP_MUL)            \
+    KIT__BLIT_SPAN(kit__blit_muladd_##fmt,        T,  0, KIT__OP_MULADD)         \
+    KIT__BLIT_SPAN(kit__blit_plain_scaled_##fmt,  T, 10, KIT__OP_PLAIN)          \
+    KIT__BLIT_SPAN(kit__blit_mul_scaled_##fmt,    T, 10, KIT__OP_MUL)            \
+    KIT__BLIT_SPAN(kit__blit_muladd_scaled_##fmt, T, 10, KIT__OP_MULADD)
+
+// the 32-bit rect spans are the simd ones above
+#define KIT__FILL_SPANS(fmt, T)                                                  \
+    static void kit__fill_span_##fmt(kit_Context *ctx, void *dst, int n, kit_Color color) { \
+        T *d = dst, p;                                                           \
+        KIT__STORE(&p, color);                                                   \
+        while (n--) { *d++ = p; }                                                \
+    }                                                                            \
+    static void kit__blend_span_##fmt(kit_Context *ctx, void *dst, int n, kit_Color color) { \
+        T *d = dst;                                                              \
+        for (; n > 0; n--, d++) { KIT__STORE(d, kit__blend_pixel(KIT__LOAD(d), color)); } \
     }
+
+#define KIT__LOAD(d)     (*(d))
+#define KIT__STORE(d, c) (*(d) = (c))
+KIT__BLIT_SPANS(rgba, kit_Color)
+#undef KIT__LOAD
+#undef KIT__STORE
+
+#define KIT__LOAD(d)     kit__load_rgb565(*(d))
+#define KIT__STORE(d, c) (*(d) = kit__pack_rgb565(c))
+KIT__BLIT_SPANS(rgb565, uint16_t)
+KIT__FILL_SPANS(rgb565, uint16_t)
+#undef KIT__LOAD
+#undef KIT__STORE
+
+#define KIT__LOAD(d)     (ctx->palette[*(d)])
+#define KIT__STORE(d, c) (*(d) = kit__pack_index(ctx, c))
+KIT__BLIT_SPANS(indexed, uint8_t)
+KIT__FILL_SPANS(indexed, uint8_t)
+#undef KIT__LOAD
+#undef KIT__STORE
+
+// [format][opaque]
+static const kit__FillSpan kit__fill_spans[3][2] = {
+    { kit__blend_span_rgba,    kit__fill_span_rgba    },
+    { kit__blend_span_rgb565,  kit__fill_span_rgb565  },
+    { kit__blend_span_indexed, kit__fill_span_indexed },
+};
+
+// [format][scaled][plain, mul, mul+add]
+#define KIT__BLIT_TABLE(fmt) {                                                   \
+    { kit__blit_plain_##fmt,        kit__blit_mul_##fmt,        kit__blit_muladd_##fmt        }, \
+    { kit__blit_plain_scaled_##fmt, kit__blit_mul_scaled_##fmt, kit__blit_muladd_scaled_##fmt }, \
 }
 
+static const kit__BlitSpan kit__blit_spans[3][2][3] = {
+    KIT__BLIT_TABLE(rgba),
+    KIT__BLIT_TABLE(rgb565),
+    KIT__BLIT_TABLE(indexed),
+};
 
-void kit_draw_image(kit_Context *ctx, kit_Image *img, int x, int y) {
-    kit_Rect dst = kit_rect(x, y, img->w, img->h);
-    kit_Rect src = kit_rect(0, 0, img->w, img->h);
-    kit_draw_image3(ctx, KIT_WHITE, KIT_BLACK, img, dst, src);
+#undef KIT__BLIT_TABLE
+#undef KIT__FILL_SPANS
+#undef KIT__BLIT_SPANS
+#undef KIT__BLIT_SPAN
+#undef KIT__OP_PLAIN
+#undef KIT__OP_MUL
+#undef KIT__OP_MULADD
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Window
+//////////////////////////////////////////////////////////////////////////////
+
+// the backend is four calls: open/close the window, present a screen rect
+// and pump events into the input state. headless builds stub them out
+
+#ifndef KIT_HEADLESS
+
+static void kit__scale_size_by_flags(int *w, int *h, int flags) {
+    if (flags & KIT_SCALE2X) { *w *= 2; *h *= 2; } else
+    if (flags & KIT_SCALE3X) { *w *= 3; *h *= 3; } else
+    if (flags & KIT_SCALE4X) { *w *= 4; *h *= 4; }
 }
 
 
-void kit_draw_image2(kit_Context *ctx, kit_Color color, kit_Image *img, int x, int y, kit_Rect src) {
-    kit_Rect dst = kit_rect(x, y, abs(src.w), abs(src.h));
-    kit_draw_image3(ctx, color, KIT_BLACK, img, dst, src);
+static kit_Rect kit__get_adjusted_window_rect(kit_Context *ctx) {
+    // work out maximum size to retain aspect ratio
+    float src_ar = (float) ctx->screen->h / ctx->screen->w;
+    float dst_ar = (float) ctx->win_h / ctx->win_w;
+    int w, h;
+    if (src_ar < dst_ar) {
+        w = ctx->win_w; h = ceil(w * src_ar);
+    } else {
+        h = ctx->win_h; w = ceil(h / src_ar);
+    }
+    // return centered rect
+    return kit_rect((ctx->win_w - w) / 2, (ctx->win_h - h) / 2, w, h);
 }
 
 
-void kit_draw_image3(kit_Context *ctx, kit_Color mul_color, kit_Color add_color, kit_Image *img, kit_Rect dst, kit_Rect src) {
-    // early exit on zero-sized anything
-    if (!src.w || !src.w || !dst.w || !dst.h) {
+static void kit__present_rect(kit_Context *ctx, kit_Rect r) {
+    // the dib starts at the rect's first row so its height is exactly r.h,
+    // which sidesteps StretchDIBits' bottom-up source coordinates
+    BITMAPINFO bmi = {
+        .bmiHeader.biSize = sizeof(BITMAPINFOHEADER),
+        .bmiHeader.biBitCount = 32,
+        .bmiHeader.biCompression = BI_RGB,
+        .bmiHeader.biPlanes = 1,
+        .bmiHeader.biWidth = ctx->screen->w,
+        .bmiHeader.biHeight = -r.h
+    };
+
+    // integer scales are widened in software and copied 1:1, which is
+    // cheaper than having gdi stretch; other sizes fall back to StretchDIBits
+    kit_Rect wr = kit__get_adjusted_window_rect(ctx);
+    int scale = wr.w / ctx->screen->w;
+    if (scale > 1 && wr.w == ctx->screen->w * scale && wr.h == ctx->screen->h * scale) {
+        kit_Image *up = ctx->upscaled;
+        if (!up || up->w != wr.w || up->h != wr.h) {
+            kit_destroy_image(up);
+            up = ctx->upscaled = kit_create_image(wr.w, wr.h);
+        }
+        kit__upscale_rect(up, ctx->screen, r, scale);
+        bmi.bmiHeader.biWidth = up->w;
+        bmi.bmiHeader.biHeight = -r.h * scale;
+        SetDIBitsToDevice(ctx->hdc,
+            wr.x + r.x * scale, wr.y + r.y * scale, r.w * scale, r.h * scale,
+            r.x * scale, 0, 0, r.h * scale,
+            &up->pixels[r.y * scale * up->w], &bmi, DIB_RGB_COLORS);
         return;
     }
 
-    /* do scaled render */
-    int cx1 = ctx->clip.x;
-    int cy1 = ctx->clip.y;
-    int cx2 = cx1 + ctx->clip.w;
-    int cy2 = cy1 + ctx->clip.h;
-    int stepx = (src.w << 10) / dst.w;
-    int stepy = (src.h << 10) / dst.h;
-    int sy = src.y << 10;
+    // map screen rect to window rect
+    int x1 = wr.x + r.x * wr.w / ctx->screen->w;
+    int y1 = wr.y + r.y * wr.h / ctx->screen->h;
+    int x2 = wr.x + (r.x + r.w) * wr.w / ctx->screen->w;
+    int y2 = wr.y + (r.y + r.h) * wr.h / ctx->screen->h;
 
-    /* vertical clipping */
-    int dy = dst.y;
-    if (dy < cy1) { sy += (cy1 - dy) * stepy; dy = cy1; }
-    int ey = kit_min(cy2, dst.y + dst.h);
+    StretchDIBits(ctx->hdc,
+        x1, y1, x2 - x1, y2 - y1,
+        r.x, 0, r.w, r.h,
+        &ctx->screen->pixels[r.y * ctx->screen->w], &bmi, DIB_RGB_COLORS, SRCCOPY);
+}
+
+
+static LRESULT CALLBACK kit__wndproc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    kit_Context *ctx = (void*) GetProp(hWnd, "kit_Context");
+
+    switch (message) {
+    case WM_PAINT:
+        kit__present_rect(ctx, kit_rect(0, 0, ctx->screen->w, ctx->screen->h));
+        ValidateRect(hWnd, 0);
+        break;
+
+    case WM_SETCURSOR:
+        if (ctx->hide_cursor && LOWORD(lParam) == HTCLIENT) {
+            SetCursor(0);
+            break;
+        }
+        goto unhandled;
+
+    case WM_KEYDOWN:
+    case WM_SYSKEYDOWN:
+        if (lParam & (1 << 30)) { // key repeat
+            break;
+        }
+        kit_inject_key(ctx, (uint8_t) wParam, true);
+        break;
+
+    case WM_KEYUP:
+    case WM_SYSKEYUP:
+        kit_inject_key(ctx, (uint8_t) wParam, false);
+        break;
+
+    case WM_CHAR:
+        if (wParam < 32) { break; }
+        kit_inject_char(ctx, wParam);
+        break;
+
+    case WM_LBUTTONDOWN: case WM_LBUTTONUP:
+    case WM_RBUTTONDOWN: case WM_RBUTTONUP:
+    case WM_MBUTTONDOWN: case WM_MBUTTONUP:;
+        int button = (message == WM_LBUTTONDOWN || message == WM_LBUTTONUP) ? 1 :
+                     (message == WM_RBUTTONDOWN || message == WM_RBUTTONUP) ? 2 : 3;
+        bool down = message == WM_LBUTTONDOWN || message == WM_RBUTTONDOWN || message == WM_MBUTTONDOWN;
+        if (down) { SetCapture(hWnd); } else { ReleaseCapture(); }
+        kit_inject_mouse_button(ctx, button, down);
+        // fallthrough
+
+    case WM_MOUSEMOVE:;
+        kit_Rect wr = kit__get_adjusted_window_rect(ctx);
+        kit_inject_mouse_pos(ctx,
+            (GET_X_LPARAM(lParam) - wr.x) * ctx->screen->w / wr.w,
+            (GET_Y_LPARAM(lParam) - wr.y) * ctx->screen->h / wr.h);
+        break;
+
+    case WM_SIZE:
+        if (wParam != SIZE_MINIMIZED) {
+            // set size
+            ctx->win_w = LOWORD(lParam);
+            ctx->win_h = HIWORD(lParam);
+            // paint window black
+            PAINTSTRUCT ps;
+            HDC hdc = BeginPaint(hWnd, &ps);
+            HBRUSH brush = CreateSolidBrush(RGB(0, 0, 0));
+            FillRect(hdc, &ps.rcPaint, brush);
+            DeleteObject(brush);
+            EndPaint(hWnd, &ps);
+            // redraw
+            RedrawWindow(ctx->hwnd, 0, 0, RDW_INVALIDATE | RDW_UPDATENOW);
+        }
+        break;
+
+    case WM_QUIT:
+    case WM_CLOSE:
+        ctx->wants_quit = true;
+        break;
+
+    default:
+unhandled:
+        return DefWindowProc(hWnd, message, wParam, lParam);
+    }
+
+    return 0;
+}
+
+
+static void kit__open_window(kit_Context *ctx, const char *title, int w, int h, int flags) {
+    RegisterClass(&(WNDCLASS) {
+        .style = CS_OWNDC | CS_HREDRAW | CS_VREDRAW,
+        .lpfnWndProc = kit__wndproc,
+        .hCursor = LoadCursor(0, IDC_ARROW),
+        .lpszClassName = title,
+        .hIcon = LoadIcon(GetModuleHandle(0), "icon"),
+    });
+
+    kit__scale_size_by_flags(&w, &h, flags);
+    RECT rect = { .right = w, .bottom = h };
+    int style = WS_OVERLAPPEDWINDOW;
+    AdjustWindowRect(&rect, style, 0);
+    ctx->hwnd = CreateWindow(
+        title, title, style,
+        CW_USEDEFAULT, CW_USEDEFAULT,
+        rect.right - rect.left, rect.bottom - rect.top,
+        0, 0, 0, 0
+    );
+    SetProp(ctx->hwnd, "kit_Context", ctx);
+
+    ShowWindow(ctx->hwnd, SW_NORMAL);
+    ctx->hdc = GetDC(ctx->hwnd);
+}
+
+
+static void kit__close_window(kit_Context *ctx) {
+    ReleaseDC(ctx->hwnd, ctx->hdc);
+    DestroyWindow(ctx->hwnd);
+    kit_destroy_image(ctx->upscaled);
+}
+
+
+static void kit__poll_events(kit_Context *ctx) {
+    MSG msg;
+    while (PeekMessage(&msg, ctx->hwnd, 0, 0, PM_REMOVE)) {
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+}
+
+#else
+
+static void kit__open_window(kit_Context *ctx, const char *title, int w, int h, int flags) {}
+static void kit__close_window(kit_Context *ctx) {}
+static void kit__present_rect(kit_Context *ctx, kit_Rect r) {}
+static void kit__poll_events(kit_Context *ctx) {}
+
+#endif
+
+
+static void *kit__font_png_data;
+static int   kit__font_png_size;
+
+kit_Context* kit_create(const char *title, int w, int h, int flags) {
+    kit_Context *ctx = kit__alloc(sizeof(kit_Context));
+
+    ctx->screen = kit_create_image(w, h);
+    ctx->step_time = kit__flags_to_step_time(flags);
+    ctx->hide_cursor = !!(flags & KIT_HIDECURSOR);
+    ctx->deferred = !!(flags & KIT_DEFERRED);
+
+    if (flags & KIT_RGB565) {
+        kit__init_rgb565();
+        ctx->format = KIT__FMT_RGB565;
+    } else if (flags & KIT_INDEXED8) {
+        ctx->format = KIT__FMT_INDEXED;
+    }
+    if (ctx->format) {
+        ctx->fb = kit__alloc(w * h * kit__format_bpp[ctx->format]);
+        // default palette is 3-3-2 rgb
+        kit_Color pal[256];
+        for (int i = 0; i < 256; i++) {
+            pal[i] = kit_rgb((i >> 5) * 255 / 7, ((i >> 2) & 7) * 255 / 7, (i & 3) * 255 / 3);
+        }
+        kit_set_palette(ctx, pal, 256);
+    }
+    ctx->clip = kit_rect(0, 0, w, h);
+    kit__add_dirty(ctx, ctx->clip);
+
+    kit__open_window(ctx, title, w, h, flags);
+#ifdef _WIN32
+    timeBeginPeriod(1);
+#endif
+
+    ctx->font = kit_load_font_mem(kit__font_png_data, kit__font_png_size);
+    ctx->prev_time = kit__now();
+    ctx->frame.last = ctx->prev_time;
+    ctx->frame.frame_time = ctx->step_time;
+#ifdef KIT_PROFILE
+    ctx->prof.mark = ctx->prev_time;
+#endif
+
+    return ctx;
+}
+
+
+static void kit__stop_threads(kit_Context *ctx);
+
+void kit_destroy(kit_Context *ctx) {
+    kit__stop_threads(ctx);
+    kit__close_window(ctx);
+    kit_destroy_image(ctx->screen);
+    kit_destroy_font(ctx->font);
+    free(ctx->cmds.data);
+    free(ctx->fb);
+    free(ctx->inverse);
+    free(ctx);
+}
+
+
+int kit_text_width(kit_Font *font, char *text) {
+    int x = 0;
+    for (uint8_t *p = (void*) text; *p; p++) {
+        x += font->glyphs[*p].xadv;
+    }
+    return x;
+}
+
+
+#ifdef KIT_PROFILE
+static void kit__end_profile_frame(kit_Context *ctx) {
+    double now = kit__now();
+    ctx->prof.cur.frame_time = now - ctx->prof.mark;
+    ctx->prof.mark = now;
+    ctx->prof.frames[ctx->prof.head] = ctx->prof.cur;
+    ctx->prof.head = (ctx->prof.head + 1) % KIT_PROFILE_FRAMES;
+    ctx->prof.count = kit_min(ctx->prof.count + 1, KIT_PROFILE_FRAMES);
+    memset(&ctx->prof.cur, 0, sizeof(ctx->prof.cur));
+}
+#endif
+
+
+bool kit_step(kit_Context *ctx, double *dt) {
+    KIT__PROF_END(ctx, work_time, ctx->prof.mark);
+
+    // finish deferred drawing, then present only what changed
+    KIT__PROF_BEGIN(flush_start);
+    kit_flush(ctx);
+    KIT__PROF_END(ctx, flush_time, flush_start);
+    KIT__PROF_BEGIN(present_start);
+    for (int i = 0; i < ctx->dirty_count; i++) {
+        if (ctx->format) { kit__expand_rect(ctx, ctx->dirty[i]); }
+        kit__present_rect(ctx, ctx->dirty[i]);
+    }
+    ctx->dirty_count = 0;
+    KIT__PROF_END(ctx, present_time, present_start);
+
+    // handle delta time / wait for next frame. frames are paced against an
+    // absolute schedule so a late frame is made up by the following ones;
+    // once a whole frame behind we resync rather than burst to catch up
+    double now = kit__now();
+    double prev = ctx->prev_time;
+    double deadline = prev + ctx->step_time;
+    if (now < deadline) {
+        KIT__PROF_BEGIN(sleep_start);
+        kit__wait_until(deadline);
+        KIT__PROF_END(ctx, sleep_time, sleep_start);
+        ctx->prev_time = deadline;
+    } else {
+        if (ctx->step_time > 0) { ctx->frame.missed++; }
+        ctx->prev_time = now < deadline + ctx->step_time ? deadline : now;
+    }
+    if (dt) { *dt = ctx->prev_time - prev; }
+
+    // track achieved frame time and jitter as moving averages
+    now = kit__now();
+    double frame_time = now - ctx->frame.last;
+    ctx->frame.last = now;
+    ctx->frame.frame_time += (frame_time - ctx->frame.frame_time) / 16;
+    ctx->frame.jitter += (fabs(frame_time - ctx->frame.frame_time) - ctx->frame.jitter) / 16;
+
+    // reset input state
+    memset(ctx->char_buf, 0, sizeof(ctx->char_buf));
+    for (int i = 0; i < sizeof(ctx->key_state); i++) {
+        ctx->key_state[i] &= ~(KIT_INPUT_PRESSED | KIT_INPUT_RELEASED);
+    }
+    for (int i = 0; i < sizeof(ctx->mouse_state); i++) {
+        ctx->mouse_state[i] &= ~(KIT_INPUT_PRESSED | KIT_INPUT_RELEASED);
+    }
+    memset(&ctx->mouse_delta, 0, sizeof(ctx->mouse_delta));
+
+    // handle events
+    KIT__PROF_BEGIN(events_start);
+    kit__poll_events(ctx);
+    KIT__PROF_END(ctx, events_time, events_start);
+    KIT__PROF_FRAME(ctx);
+    return !ctx->wants_quit;
+}
+
+
+void kit_frame_stats(kit_Context *ctx, double *frame_time, double *jitter, int *missed) {
+    if (frame_time) { *frame_time = ctx->frame.frame_time; }
+    if (jitter)     { *jitter     = ctx->frame.jitter; }
+    if (missed)     { *missed     = ctx->frame.missed; }
+}
+
+
+// maps a file read-only; it stays valid until kit_unmap_file(). returns NULL
+// if the file can't be opened, isn't a regular file or doesn't fit in memory
+void* kit_map_file(char *filename, size_t *len) {
+    size_t n;
+    void *data = kit__map_file(filename, &n);
+    if (data && len) { *len = n; }
+    return data;
+}
+
+
+void kit_unmap_file(void *data, size_t len) {
+    if (data) { kit__unmap_file(data, len); }
+}
+
+
+// a private, nul-terminated copy of the file, or NULL on failure
+void* kit_read_file(char *filename, size_t *len) {
+    size_t n;
+    void *data = kit_map_file(filename, &n);
+    if (!data) { return NULL; }
+    char *buf = n < SIZE_MAX ? malloc(n + 1) : NULL;
+    if (buf) {
+        memcpy(buf, data, n);
+        buf[n] = '\0';
+        if (len) { *len = n; }
+    }
+    kit_unmap_file(data, n);
+    return buf;
+}
+
+
+kit_Image* kit_create_image(int w, int h) {
+    kit__expect(w > 0 && h > 0);
+    kit_Image *img = kit__alloc(sizeof(kit_Image) + w * h * sizeof(kit_Color));
+    img->pixels = (void*) (img + 1);
+    img->w = w;
+    img->h = h;
+    return img;
+}
+
+
+// decodes straight from the mapped file, so the data is never copied
+kit_Image* kit_load_image_file(char *filename) {
+    size_t len;
+    void *data = kit_map_file(filename, &len);
+    if (!data) { return NULL; }
+    kit_Image *res = len <= 0x7fffffff ? kit_load_image_mem(data, len) : NULL;
+    kit_unmap_file(data, len);
+    return res;
+}
+
+
+static kit_Image* kit__load_png(void *data, int len);
+
+kit_Image* kit_load_image_mem(void *data, int len) {
+    return kit__load_png(data, len);
+}
+
+
+void kit_destroy_image(kit_Image *img) {
+    free(img);
+}
+
+
+void kit_premultiply_image(kit_Image *img) {
+    kit__premultiply_row(img->pixels, img->w * img->h);
+}
+
+
+void kit_upscale_image(kit_Image *dst, kit_Image *src, int scale) {
+    kit__expect(scale >= 1);
+    kit__expect(dst->w >= src->w * scale && dst->h >= src->h * scale);
+    kit__upscale_rect(dst, src, kit_rect(0, 0, src->w, src->h), scale);
+}
+
+
+// rle runs are 16 bits: kind in the top 2 bits, length in the low 14
+enum { KIT__RUN_SKIP, KIT__RUN_COPY, KIT__RUN_BLEND };
+
+static int kit__run_kind(kit_Color c) {
+    return c.a == 0 ? KIT__RUN_SKIP : c.a == 0xff ? KIT__RUN_COPY : KIT__RUN_BLEND;
+}
+
+
+static int kit__encode_rle_row(kit_Color *row, int w, uint16_t *out) {
+    int n = 0;
+    for (int x = 0; x < w;) {
+        int kind = kit__run_kind(row[x]);
+        int len = 1;
+        while (x + len < w && len < 0x3fff && kit__run_kind(row[x + len]) == kind) { len++; }
+        if (out) { out[n] = (kind << 14) | len; }
+        n++;
+        x += len;
+    }
+    return n;
+}
+
+
+kit_RleImage* kit_compile_image(kit_Image *img) {
+    // count runs so everything fits in one allocation
+    int n = 0;
+    for (int y = 0; y < img->h; y++) {
+        n += kit__encode_rle_row(&img->pixels[y * img->w], img->w, NULL);
+    }
+    kit_RleImage *res = kit__alloc(sizeof(kit_RleImage) + img->h * sizeof(uint32_t) + n * sizeof(uint16_t));
+    res->rows = (void*) (res + 1);
+    res->runs = (void*) (res->rows + img->h);
+
+    // encode rows, keeping a copy of the pixels for copied/blended runs
+    n = 0;
+    for (int y = 0; y < img->h; y++) {
+        res->rows[y] = n;
+        n += kit__encode_rle_row(&img->pixels[y * img->w], img->w, &res->runs[n]);
+    }
+    res->image = kit_create_image(img->w, img->h);
+    memcpy(res->image->pixels, img->pixels, img->w * img->h * sizeof(kit_Color));
+
+    return res;
+}
+
+
+void kit_destroy_rle_image(kit_RleImage *img) {
+    kit_destroy_image(img->image);
+    free(img);
+}
+
+
+static bool kit__check_column(kit_Image *img, int x, int y, int h) {
+    while (h > 0) {
+        if (img->pixels[x + y * img->w].a) {
+            return true;
+        }
+        y++; h--;
+    }
+    return false;
+}
+
+
+static kit_Font* kit__load_font_from_image(kit_Image *img) {
+    if (!img) { return NULL; }
+    kit_Font *font = kit__alloc(sizeof(kit_Font));
+    font->image = img;
+
+    // init glyphs
+    for (int i = 0; i < 256; i++) {
+        kit_Glyph *g = &font->glyphs[i];
+        kit_Rect r = {
+            (img->w / 16) * (i % 16),
+            (img->h / 16) * (i / 16),
+            img->w / 16,
+            img->h / 16
+        };
+        // right-trim rect
+        for (int x = r.x + r.w - 1; x >= r.x; x--) {
+            if (kit__check_column(font->image, x, r.y, r.h)) { break; }
+            r.w--;
+        }
+        // left-trim rect
+        for (int x = r.x; x < r.x + r.w; x++) {
+            if (kit__check_column(font->image, x, r.y, r.h)) { break; }
+            r.x++;
+            r.w--;
+        }
+        // set xadvance and rect
+        g->xadv = r.w + 1;
+        g->rect = r;
+    }
+
+    font->glyphs[' '].rect = (kit_Rect) {0};
+    font->glyphs[' '].xadv = font->glyphs['a'].xadv;
+
+    return font;
+}
+
+
+kit_Font* kit_load_font_file(char *filename) {
+    return kit__load_font_from_image(kit_load_image_file(filename));
+}
+
+
+kit_Font* kit_load_font_mem(void *data, int len) {
+    return kit__load_font_from_image(kit_load_image_mem(data, len));
+}
+
+
+static void kit__text_cache_trim(struct kit__TextCache *c, int budget);
+
+// the font and its cached strips may be queued in the command buffer, so
+// flush first
+void kit_destroy_font(kit_Font *font) {
+    if (font->cache) { kit__text_cache_trim(font->cache, 0); }
+    free(font->cache);
+    free(font->image);
+    free(font);
+}
+
+
+int kit_get_char(kit_Context *ctx) {
+    for (int i = 0; i < kit_lengthof(ctx->char_buf); i++) {
+        if (!ctx->char_buf[i]) { continue; }
+        int res = ctx->char_buf[i];
+        ctx->char_buf[i] = 0;
+        return res;
+    }
+    return 0;
+}
+
+
+bool kit_key_down(kit_Context *ctx, int key) {
+    return kit__check_input_flag(ctx->key_state, key, sizeof(ctx->key_state), KIT_INPUT_DOWN);
+}
+
+
+bool kit_key_pressed(kit_Context *ctx, int key) {
+    return kit__check_input_flag(ctx->key_state, key, sizeof(ctx->key_state), KIT_INPUT_PRESSED);
+}
+
+
+bool kit_key_released(kit_Context *ctx, int key) {
+    return kit__check_input_flag(ctx->key_state, key, sizeof(ctx->key_state), KIT_INPUT_RELEASED);
+}
+
+
+void kit_mouse_pos(kit_Context *ctx, int *x, int *y) {
+    if (x) { *x = ctx->mouse_pos.x; }
+    if (y) { *y = ctx->mouse_pos.y; }
+}
+
+
+void kit_mouse_delta(kit_Context *ctx, int *x, int *y) {
+    if (x) { *x = ctx->mouse_delta.x; }
+    if (y) { *y = ctx->mouse_delta.y; }
+}
+
+
+bool kit_mouse_down(kit_Context *ctx, int button) {
+    return kit__check_input_flag(ctx->mouse_state, button, sizeof(ctx->mouse_state), KIT_INPUT_DOWN);
+}
+
+
+bool kit_mouse_pressed(kit_Context *ctx, int button) {
+    return kit__check_input_flag(ctx->mouse_state, button, sizeof(ctx->mouse_state), KIT_INPUT_PRESSED);
+}
+
+
+bool kit_mouse_released(kit_Context *ctx, int button) {
+    return kit__check_input_flag(ctx->mouse_state, button, sizeof(ctx->mouse_state), KIT_INPUT_RELEASED);
+}
+
+
+// the window backend feeds its events through these too. kit_step() clears
+// pressed/released state before polling, so inject input after kit_step()
+// for it to be seen during that frame
+void kit_inject_key(kit_Context *ctx, int key, bool down) {
+    if (key < 0 || key >= sizeof(ctx->key_state)) { return; }
+    if (down) {
+        ctx->key_state[key] = KIT_INPUT_DOWN | KIT_INPUT_PRESSED;
+    } else {
+        ctx->key_state[key] &= ~KIT_INPUT_DOWN;
+        ctx->key_state[key] |=  KIT_INPUT_RELEASED;
+    }
+}
+
+
+void kit_inject_char(kit_Context *ctx, int chr) {
+    for (int i = 0; i < kit_lengthof(ctx->char_buf); i++) {
+        if (ctx->char_buf[i]) { continue; }
+        ctx->char_buf[i] = chr;
+        break;
+    }
+}
+
+
+void kit_inject_mouse_pos(kit_Context *ctx, int x, int y) {
+    ctx->mouse_delta.x += x - ctx->mouse_pos.x;
+    ctx->mouse_delta.y += y - ctx->mouse_pos.y;
+    ctx->mouse_pos.x = x;
+    ctx->mouse_pos.y = y;
+}
+
+
+void kit_inject_mouse_button(kit_Context *ctx, int button, bool down) {
+    if (button < 0 || button >= sizeof(ctx->mouse_state)) { return; }
+    if (down) {
+        ctx->mouse_state[button] = KIT_INPUT_DOWN | KIT_INPUT_PRESSED;
+    } else {
+        ctx->mouse_state[button] &= ~KIT_INPUT_DOWN;
+        ctx->mouse_state[button] |=  KIT_INPUT_RELEASED;
+    }
+}
+
+
+void kit_clear(kit_Context *ctx, kit_Color color) {
+    kit_draw_rect(ctx, color, KIT_BIG_RECT);
+}
+
+
+void kit_set_clip(kit_Context *ctx, kit_Rect rect) {
+    kit_Rect screen_rect = kit_rect(0, 0, ctx->screen->w, ctx->screen->h);
+    ctx->clip = kit__intersect_rects(rect, screen_rect);
+}
+
+
+void kit_set_palette(kit_Context *ctx, kit_Color *colors, int n) {
+    kit__expect(n > 0 && n <= 256);
+    memset(ctx->palette, 0, sizeof(ctx->palette));
+    for (int i = 0; i < n; i++) {
+        ctx->palette[i] = colors[i];
+        ctx->palette[i].a = 0xff;
+    }
+
+    // rebuild the rgb555 -> nearest palette index table
+    if (!ctx->inverse) { ctx->inverse = kit__alloc(1 << 15); }
+    for (int i = 0; i < (1 << 15); i++) {
+        int r = ((i >> 10) << 3) | 4;
+        int g = (((i >> 5) & 31) << 3) | 4;
+        int b = ((i & 31) << 3) | 4;
+        int best = 0, best_dist = INT32_MAX;
+        for (int j = 0; j < n && best_dist; j++) {
+            kit_Color c = ctx->palette[j];
+            int dist = (c.r - r) * (c.r - r) + (c.g - g) * (c.g - g) + (c.b - b) * (c.b - b);
+            if (dist < best_dist) { best = j; best_dist = dist; }
+        }
+        ctx->inverse[i] = best;
+    }
+
+    // every pixel may have changed color
+    kit_mark_dirty(ctx, KIT_BIG_RECT);
+}
+
+
+void kit_mark_dirty(kit_Context *ctx, kit_Rect rect) {
+    kit_Rect screen_rect = kit_rect(0, 0, ctx->screen->w, ctx->screen->h);
+    kit__add_dirty(ctx, kit__intersect_rects(rect, screen_rect));
+}
+
+
+int kit_dirty_rects(kit_Context *ctx, kit_Rect *rects, int max) {
+    int n = kit_min(max, ctx->dirty_count);
+    if (rects) { memcpy(rects, ctx->dirty, n * sizeof(kit_Rect)); }
+    return ctx->dirty_count;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Rasterizers
+//////////////////////////////////////////////////////////////////////////////
+
+// these write into ctx->screen limited to `clip`, which the callers have
+// already intersected with ctx->clip (and a tile, when deferred)
+
+// blit span variant: 0 plain, 1 mul, 2 mul+add
+static inline int kit__blend_op(kit_Color mul_color, kit_Color add_color) {
+    if (add_color.w & 0xffffff) { return 2; }
+    return mul_color.w != 0xffffffff;
+}
+
+
+static void kit__plot(kit_Context *ctx, kit_Rect clip, kit_Color color, int x, int y) {
+    if (x < clip.x || y < clip.y || x >= clip.x + clip.w || y >= clip.y + clip.h ) {
+        return;
+    }
+    if (ctx->format) {
+        kit__fill_spans[ctx->format][0](ctx, kit__pixel_addr(ctx, x, y), 1, color);
+        return;
+    }
+    kit_Color *dst = &ctx->screen->pixels[x + y * ctx->screen->w];
+    *dst = kit__blend_pixel(*dst, color);
+}
+
+
+static void kit__raster_rect(kit_Context *ctx, kit_Rect clip, kit_Color color, kit_Rect rect) {
+    rect = kit__intersect_rects(rect, clip);
+    if (rect.w <= 0 || rect.h <= 0) { return; }
+    uint8_t *d = kit__pixel_addr(ctx, rect.x, rect.y);
+    int stride = ctx->screen->w * kit__format_bpp[ctx->format];
+    // opaque fills are plain stores, everything else blends
+    kit__FillSpan span = kit__fill_spans[ctx->format][color.a == 0xff];
+    for (int y = 0; y < rect.h; y++) {
+        span(ctx, d, rect.w, color);
+        d += stride;
+    }
+}
+
+
+static void kit__raster_line(kit_Context *ctx, kit_Rect clip, kit_Color color, int x1, int y1, int x2, int y2) {
+    int dx = abs(x2-x1);
+    int sx = x1 < x2 ? 1 : -1;
+    int dy = -abs(y2 - y1);
+    int sy = y1 < y2 ? 1 : -1;
+    int err = dx + dy;
+    for (;;) {
+        kit__plot(ctx, clip, color, x1, y1);
+        if (x1 == x2 && y1 == y2) { break; }
+        int e2 = err << 1;
+        if (e2 >= dy) { err += dy; x1 += sx; }
+        if (e2 <= dx) { err += dx; y1 += sy; }
+    }
+}
+
+
+static void kit__raster_image(kit_Context *ctx, kit_Rect clip, kit_Color mul_color, kit_Color add_color, kit_Image *img, kit_Rect dst, kit_Rect src) {
+    /* do scaled render */
+    int cx1 = clip.x;
+    int cy1 = clip.y;
+    int cx2 = cx1 + clip.w;
+    int cy2 = cy1 + clip.h;
+    int stepx = (src.w << 10) / dst.w;
+    int stepy = (src.h << 10) / dst.h;
+    int sy = src.y << 10;
+
+    /* vertical clipping */
+    int dy = dst.y;
+    if (dy < cy1) { sy += (cy1 - dy) * stepy; dy = cy1; }
+    int ey = kit_min(cy2, dst.y + dst.h);
+
+    /* horizontal clipping */
+    int sx = src.x << 10;
+    int dx = dst.x;
+    if (dx < cx1) { sx += (cx1 - dx) * stepx; dx = cx1; }
+    int ex = kit_min(cx2, dst.x + dst.w);
+    if (dx >= ex) { return; }
+
+    /* pick span variant once; 1:1 draws step whole texels */
+    int op = kit__blend_op(mul_color, add_color);
+    bool scaled = abs(stepx) != 1 << 10;
+    kit__BlitSpan span = kit__blit_spans[ctx->format][scaled][op];
+    if (!scaled) { sx >>= 10; stepx >>= 10; }
+
+    uint8_t *drow = kit__pixel_addr(ctx, dx, dy);
+    int stride = ctx->screen->w * kit__format_bpp[ctx->format];
+    for (; dy < ey; dy++) {
+        kit_Color *srow = &img->pixels[(sy >> 10) * img->w];
+        span(ctx, drow, srow, ex - dx, sx, stepx, mul_color, add_color);
+        drow += stride;
+        sy += stepy;
+    }
+}
+
+
+// expects `src` to lie inside the image, see kit_draw_rle_image()
+static void kit__raster_rle(kit_Context *ctx, kit_Rect clip, kit_Color mul_color, kit_Color add_color, kit_RleImage *img, int x, int y, kit_Rect src) {
+    // visible rect on screen; `ox` maps image columns to screen columns
+    kit_Rect r = kit__intersect_rects(kit_rect(x, y, src.w, src.h), clip);
+    if (r.w <= 0 || r.h <= 0) { return; }
+    int ox = x - src.x;
+    int sx1 = r.x - ox;
+    int sx2 = sx1 + r.w;
+
+    int op = kit__blend_op(mul_color, add_color);
+    kit__BlitSpan span = kit__blit_spans[ctx->format][0][op];
+    int bpp = kit__format_bpp[ctx->format];
+
+    kit_Image *im = img->image;
+    for (int dy = r.y; dy < r.y + r.h; dy++) {
+        int sy = dy - y + src.y;
+        kit_Color *srow = &im->pixels[sy * im->w];
+        uint8_t *drow = kit__pixel_addr(ctx, 0, dy);
+        uint16_t *run = &img->runs[img->rows[sy]];
+        for (int rx = 0; rx < sx2; run++) {
+            int kind = *run >> 14;
+            int a = kit_max(rx, sx1);
+            rx += *run & 0x3fff;
+            int b = kit_min(rx, sx2);
+            if (a >= b || kind == KIT__RUN_SKIP) { continue; }
+            if (kind == KIT__RUN_COPY && op == 0 && !ctx->format) {
+                memcpy(&drow[(a + ox) * bpp], &srow[a], (b - a) * sizeof(kit_Color));
+            } else {
+                span(ctx, &drow[(a + ox) * bpp], srow, b - a, a, 1, mul_color, add_color);
+            }
+        }
+    }
+}
+
+
+// expects the sprite's `src` to lie inside the image and its `mul` to be
+// premultiplied, see kit_draw_sprites()
+static void kit__raster_sprite(kit_Context *ctx, kit_Rect clip, kit_Image *img, kit_Sprite *s) {
+    kit_Rect r = kit__intersect_rects(kit_rect(s->x, s->y, s->src.w, s->src.h), clip);
+    if (r.w <= 0 || r.h <= 0) { return; }
+    kit__BlitSpan span = kit__blit_spans[ctx->format][0][kit__blend_op(s->mul, s->add)];
+    int sx = s->src.x + r.x - s->x;
+    kit_Color *srow = &img->pixels[(s->src.y + r.y - s->y) * img->w];
+    uint8_t *drow = kit__pixel_addr(ctx, r.x, r.y);
+    int stride = ctx->screen->w * kit__format_bpp[ctx->format];
+    for (int y = 0; y < r.h; y++) {
+        span(ctx, drow, srow, r.w, sx, 1, s->mul, s->add);
+        drow += stride;
+        srow += img->w;
+    }
+}
+
+
+// inverse mapping of an affine draw in 16.16 fixed point: the pixel centre at
+// bounds.x + i, bounds.y + j samples texel (u + i * du_dx + j * du_dy) >> 16,
+// likewise for v. every replay steps from the same origin, so tiles agree
+typedef struct {
+    int64_t u, v;
+    int32_t du_dx, dv_dx, du_dy, dv_dy;
+} kit__Affine;
+
+
+static inline int64_t kit__floor_div(int64_t a, int64_t b) {
+    return a / b - (a % b != 0 && a < 0);
+}
+
+
+// narrows [*k1, *k2) to the steps k for which lo <= p + k * d < hi
+static void kit__affine_range(int64_t p, int64_t d, int64_t lo, int64_t hi, int *k1, int *k2) {
+    int64_t a, b;
+    if (d == 0) {
+        if (p < lo || p >= hi) { *k2 = *k1; }
+        return;
+    }
+    if (d > 0) {
+        a = -kit__floor_div(p - lo, d);
+        b = -kit__floor_div(p - hi, d);
+    } else {
+        a = kit__floor_div(p - hi, -d) + 1;
+        b = kit__floor_div(p - lo, -d) + 1;
+    }
+    if (a > *k1) { *k1 = (int) kit_min(a, *k2); }
+    if (b < *k2) { *k2 = (int) kit_max(b, *k1); }
+}
+
+
+// fetches `n` texels along a span; every one is inside the image. the
+// vector paths build row * w + column with one 16-bit multiply-add, so
+// images of 32768 pixels or more a side take the scalar loop
+static void kit__affine_gather(kit_Color *dst, kit_Image *img, int64_t u, int64_t v, int32_t du, int32_t dv, int n) {
+    kit_Color *px = img->pixels;
+    int i = 0;
+#if defined(KIT__SSE2) || defined(KIT__AVX2)
+    bool vector = img->w < 0x8000 && img->h < 0x8000;
+#endif
+#if defined(KIT__AVX2)
+    __m256i step = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i vu  = _mm256_add_epi32(_mm256_set1_epi32((int32_t) u), _mm256_mullo_epi32(step, _mm256_set1_epi32(du)));
+    __m256i vv  = _mm256_add_epi32(_mm256_set1_epi32((int32_t) v), _mm256_mullo_epi32(step, _mm256_set1_epi32(dv)));
+    __m256i du8 = _mm256_set1_epi32((uint32_t) du * 8);
+    __m256i dv8 = _mm256_set1_epi32((uint32_t) dv * 8);
+    __m256i w   = _mm256_set1_epi32(0x10000 | img->w);
+    for (; vector && i + 8 <= n; i += 8) {
+        __m256i uv = _mm256_or_si256(_mm256_and_si256(vu, _mm256_set1_epi32(0xffff0000)), _mm256_srli_epi32(vv, 16));
+        __m256i idx = _mm256_madd_epi16(uv, w);
+        _mm256_storeu_si256((__m256i*) &dst[i], _mm256_i32gather_epi32((int*) px, idx, 4));
+        vu = _mm256_add_epi32(vu, du8);
+        vv = _mm256_add_epi32(vv, dv8);
+    }
+#elif defined(KIT__SSE2)
+    // no gather, but the indices still come four at a time
+    __m128i vu  = _mm_setr_epi32((int32_t) u, (int32_t) (u + du), (int32_t) (u + du * 2), (int32_t) (u + du * 3));
+    __m128i vv  = _mm_setr_epi32((int32_t) v, (int32_t) (v + dv), (int32_t) (v + dv * 2), (int32_t) (v + dv * 3));
+    __m128i du4 = _mm_set1_epi32((uint32_t) du * 4);
+    __m128i dv4 = _mm_set1_epi32((uint32_t) dv * 4);
+    __m128i w   = _mm_set1_epi32(0x10000 | img->w);
+    for (; vector && i + 4 <= n; i += 4) {
+        __m128i uv = _mm_or_si128(_mm_and_si128(vu, _mm_set1_epi32(0xffff0000)), _mm_srli_epi32(vv, 16));
+        int32_t idx[4];
+        _mm_storeu_si128((__m128i*) idx, _mm_madd_epi16(uv, w));
+        dst[i]     = px[idx[0]];
+        dst[i + 1] = px[idx[1]];
+        dst[i + 2] = px[idx[2]];
+        dst[i + 3] = px[idx[3]];
+        vu = _mm_add_epi32(vu, du4);
+        vv = _mm_add_epi32(vv, dv4);
+    }
+#endif
+    u += (int64_t) du * i;
+    v += (int64_t) dv * i;
+    for (; i < n; i++, u += du, v += dv) {
+        dst[i] = px[(v >> 16) * img->w + (u >> 16)];
+    }
+}
+
+
+// `src` is the part of the image that may be sampled, already inside it.
+// each row's span is solved exactly against it, then gathered into a strip
+// and blended with the ordinary 1:1 spans
+static void kit__raster_affine(kit_Context *ctx, kit_Rect clip, kit_Color mul_color, kit_Color add_color, kit_Image *img, kit_Rect src, kit_Rect bounds, kit__Affine *t) {
+    kit__BlitSpan span = kit__blit_spans[ctx->format][0][kit__blend_op(mul_color, add_color)];
+    int bpp = kit__format_bpp[ctx->format];
+    int64_t u1 = (int64_t) src.x << 16, u2 = (int64_t) (src.x + src.w) << 16;
+    int64_t v1 = (int64_t) src.y << 16, v2 = (int64_t) (src.y + src.h) << 16;
+    kit_Color strip[256];
+
+    for (int y = clip.y; y < clip.y + clip.h; y++) {
+        int64_t u = t->u + (int64_t) (y - bounds.y) * t->du_dy;
+        int64_t v = t->v + (int64_t) (y - bounds.y) * t->dv_dy;
+        int k1 = clip.x - bounds.x, k2 = k1 + clip.w;
+        kit__affine_range(u, t->du_dx, u1, u2, &k1, &k2);
+        kit__affine_range(v, t->dv_dx, v1, v2, &k1, &k2);
+        if (k1 >= k2) { continue; }
+
+        uint8_t *d = kit__pixel_addr(ctx, bounds.x + k1, y);
+        for (int k = k1; k < k2; k += kit_lengthof(strip)) {
+            int n = kit_min(k2 - k, (int) kit_lengthof(strip));
+            kit__affine_gather(strip, img, u + (int64_t) k * t->du_dx, v + (int64_t) k * t->dv_dx, t->du_dx, t->dv_dx, n);
+            span(ctx, d, strip, n, 0, 1, mul_color, add_color);
+            d += n * bpp;
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Command buffer
+//////////////////////////////////////////////////////////////////////////////
+
+// in deferred mode draw calls are recorded here and replayed by kit_flush()
+// one tile at a time. every command carries its on-screen bounds (already
+// clipped), which doubles as its clip rect on replay. images are referenced,
+// not copied, so they must stay alive and unchanged until the flush
+
+enum { KIT__CMD_RECT, KIT__CMD_LINE, KIT__CMD_IMAGE, KIT__CMD_RLE, KIT__CMD_SPRITES, KIT__CMD_AFFINE };
+
+// sprite instances are copied into the command, so a batch is split into
+// commands small enough for the 16-bit `size`
+#define KIT__SPRITES_PER_CMD 1024
+
+typedef struct { uint16_t type, size; kit_Rect bounds; } kit__Cmd;
+typedef struct { kit__Cmd cmd; kit_Color color; } kit__RectCmd;
+typedef struct { kit__Cmd cmd; kit_Color color; int x1, y1, x2, y2; } kit__LineCmd;
+typedef struct { kit__Cmd cmd; kit_Color mul_color, add_color; kit_Image *img; kit_Rect dst, src; } kit__ImageCmd;
+typedef struct { kit__Cmd cmd; kit_Color mul_color, add_color; kit_RleImage *img; int x, y; kit_Rect src; } kit__RleCmd;
+typedef struct { kit__Cmd cmd; kit_Image *img; int count; kit_Sprite sprites[]; } kit__SpritesCmd;
+typedef struct { kit__Cmd cmd; kit_Color mul_color, add_color; kit_Image *img; kit_Rect src; kit__Affine t; } kit__AffineCmd;
+
+
+// pixels covered by `r`, 0 if it's empty
+static inline int64_t kit__rect_area(kit_Rect r) {
+    return r.w > 0 && r.h > 0 ? (int64_t) r.w * r.h : 0;
+}
+
+
+// clips `bounds` to ctx->clip and marks it dirty; false if nothing is visible
+static bool kit__begin_draw(kit_Context *ctx, kit_Rect *bounds) {
+    kit_Rect r = kit__intersect_rects(*bounds, ctx->clip);
+    KIT__PROF_COUNT(ctx, draw_calls, 1);
+    KIT__PROF_COUNT(ctx, clipped_pixels, kit__rect_area(*bounds) - kit__rect_area(r));
+    *bounds = r;
+    if (bounds->w <= 0 || bounds->h <= 0) { return false; }
+    kit__add_dirty(ctx, *bounds);
+    return true;
+}
+
+
+// room for a command of up to `size` bytes at the end of the buffer; it only
+// becomes part of the buffer once kit__push_cmd() is called with it
+static void* kit__reserve_cmd(kit_Context *ctx, int size) {
+    size = (size + 7) & ~7;
+    while (ctx->cmds.len + size > ctx->cmds.cap) {
+        ctx->cmds.cap = kit_max(ctx->cmds.cap * 2, 4096);
+        ctx->cmds.data = realloc(ctx->cmds.data, ctx->cmds.cap);
+        if (!ctx->cmds.data) { kit__panic("out of memory"); }
+    }
+    return ctx->cmds.data + ctx->cmds.len;
+}
+
+
+static void* kit__push_cmd(kit_Context *ctx, int type, int size, kit_Rect bounds) {
+    kit__Cmd *cmd = kit__reserve_cmd(ctx, size);
+    size = (size + 7) & ~7;
+    cmd->type = type;
+    cmd->size = size;
+    cmd->bounds = bounds;
+    ctx->cmds.bounds = ctx->cmds.count ? kit__merge_rects(ctx->cmds.bounds, bounds) : bounds;
+    ctx->cmds.len += size;
+    ctx->cmds.count++;
+    return cmd;
+}
+
+
+static void kit__run_cmds(kit_Context *ctx, kit_Rect tile) {
+    uint8_t *p = ctx->cmds.data;
+    uint8_t *end = p + ctx->cmds.len;
+    for (; p < end; p += ((kit__Cmd*) p)->size) {
+        kit__Cmd *cmd = (void*) p;
+        kit_Rect clip = kit__intersect_rects(cmd->bounds, tile);
+        if (clip.w <= 0 || clip.h <= 0) { continue; }
+
+        switch (cmd->type) {
+        case KIT__CMD_RECT: {
+            kit__RectCmd *c = (void*) cmd;
+            kit__raster_rect(ctx, clip, c->color, cmd->bounds);
+            break;
+        }
+        case KIT__CMD_LINE: {
+            kit__LineCmd *c = (void*) cmd;
+            kit__raster_line(ctx, clip, c->color, c->x1, c->y1, c->x2, c->y2);
+            break;
+        }
+        case KIT__CMD_IMAGE: {
+            kit__ImageCmd *c = (void*) cmd;
+            kit__raster_image(ctx, clip, c->mul_color, c->add_color, c->img, c->dst, c->src);
+            break;
+        }
+        case KIT__CMD_RLE: {
+            kit__RleCmd *c = (void*) cmd;
+            kit__raster_rle(ctx, clip, c->mul_color, c->add_color, c->img, c->x, c->y, c->src);
+            break;
+        }
+        case KIT__CMD_AFFINE: {
+            kit__AffineCmd *c = (void*) cmd;
+            kit__raster_affine(ctx, clip, c->mul_color, c->add_color, c->img, c->src, cmd->bounds, &c->t);
+            break;
+        }
+        case KIT__CMD_SPRITES: {
+            kit__SpritesCmd *c = (void*) cmd;
+            for (int i = 0; i < c->count; i++) {
+                kit__raster_sprite(ctx, clip, c->img, &c->sprites[i]);
+            }
+            break;
+        }
+        }
+    }
+}
+
+
+// called on the main thread and every worker; tiles are handed out through
+// an atomic counter so each is replayed exactly once, in command order
+static void kit__run_tiles(kit_Context *ctx) {
+    for (;;) {
+        int i = kit__atomic_inc(&ctx->tiles.next) - 1;
+        if (i >= ctx->tiles.count) { break; }
+        int x = ctx->tiles.x + (i % ctx->tiles.cols) * KIT_TILE_SIZE;
+        int y = ctx->tiles.y + (i / ctx->tiles.cols) * KIT_TILE_SIZE;
+        kit_Rect tile = kit_rect(x, y, KIT_TILE_SIZE, KIT_TILE_SIZE);
+        kit__run_cmds(ctx, kit__intersect_rects(tile, ctx->cmds.bounds));
+    }
+}
+
+
+static void kit__worker(void *arg) {
+    kit_Context *ctx = arg;
+    for (;;) {
+        kit__sem_wait(&ctx->thread_start);
+        if (ctx->threads_quit) { break; }
+        kit__run_tiles(ctx);
+        kit__sem_post(&ctx->thread_done, 1);
+    }
+}
+
+
+void kit_flush(kit_Context *ctx) {
+    if (!ctx->cmds.count) { return; }
+
+    // split the touched area into grid-aligned tiles
+    kit_Rect area = ctx->cmds.bounds;
+    ctx->tiles.x = area.x - area.x % KIT_TILE_SIZE;
+    ctx->tiles.y = area.y - area.y % KIT_TILE_SIZE;
+    ctx->tiles.cols = (area.x + area.w - ctx->tiles.x + KIT_TILE_SIZE - 1) / KIT_TILE_SIZE;
+    int rows = (area.y + area.h - ctx->tiles.y + KIT_TILE_SIZE - 1) / KIT_TILE_SIZE;
+    ctx->tiles.count = ctx->tiles.cols * rows;
+    ctx->tiles.next = 0;
+
+    // wake the workers, help out, then wait for all of them to finish. the
+    // semaphores only exist while there are workers
+    if (ctx->thread_count) { kit__sem_post(&ctx->thread_start, ctx->thread_count); }
+    kit__run_tiles(ctx);
+    if (ctx->thread_count) {
+        for (int i = 0; i < ctx->thread_count; i++) {
+            kit__sem_wait(&ctx->thread_done);
+        }
+    }
+
+    ctx->cmds.len = 0;
+    ctx->cmds.count = 0;
+}
+
+
+static void kit__stop_threads(kit_Context *ctx) {
+    if (!ctx->thread_count) { return; }
+    ctx->threads_quit = true;
+    kit__sem_post(&ctx->thread_start, ctx->thread_count);
+    for (int i = 0; i < ctx->thread_count; i++) {
+        kit__join_thread(ctx->threads[i]);
+    }
+    kit__sem_destroy(&ctx->thread_start);
+    kit__sem_destroy(&ctx->thread_done);
+    free(ctx->threads);
+    ctx->threads = NULL;
+    ctx->thread_count = 0;
+    ctx->threads_quit = false;
+}
+
+
+void kit_set_threads(kit_Context *ctx, int n) {
+    kit_flush(ctx);
+    kit__stop_threads(ctx);
+    if (n <= 0) { n = kit__cpu_count(); }
+    if (n <= 1) { return; }
+
+    // the calling thread renders too, so spawn one fewer; threaded
+    // rendering replays recorded commands, so it implies deferred mode
+    ctx->deferred = true;
+    ctx->thread_count = n - 1;
+    ctx->threads = kit__alloc(ctx->thread_count * sizeof(kit__Thread));
+    kit__sem_init(&ctx->thread_start);
+    kit__sem_init(&ctx->thread_done);
+    for (int i = 0; i < ctx->thread_count; i++) {
+        kit__start_thread(&ctx->threads[i], kit__worker, ctx);
+    }
+}
+
+
+void kit_command_stats(kit_Context *ctx, int *count, int *bytes) {
+    if (count) { *count = ctx->cmds.count; }
+    if (bytes) { *bytes = ctx->cmds.len; }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Drawing
+//////////////////////////////////////////////////////////////////////////////
+
+void kit_draw_point(kit_Context *ctx, kit_Color color, int x, int y) {
+    kit_draw_line(ctx, color, x, y, x, y);
+}
+
+
+void kit_draw_rect(kit_Context *ctx, kit_Color color, kit_Rect rect) {
+    if (color.a == 0) { return; }
+    color = kit__premultiply(color);
+    if (!kit__begin_draw(ctx, &rect)) { return; }
+    KIT__PROF_COUNT(ctx, fill_pixels, kit__rect_area(rect));
+    if (ctx->deferred) {
+        kit__RectCmd *c = kit__push_cmd(ctx, KIT__CMD_RECT, sizeof(*c), rect);
+        c->color = color;
+        return;
+    }
+    kit__raster_rect(ctx, rect, color, rect);
+}
+
+
+void kit_draw_line(kit_Context *ctx, kit_Color color, int x1, int y1, int x2, int y2) {
+    if (color.a == 0) { return; }
+    color = kit__premultiply(color);
+    kit_Rect bounds = kit_rect(kit_min(x1, x2), kit_min(y1, y2), abs(x2 - x1) + 1, abs(y2 - y1) + 1);
+    if (!kit__begin_draw(ctx, &bounds)) { return; }
+    KIT__PROF_COUNT(ctx, fill_pixels, kit_max(bounds.w, bounds.h));
+    if (ctx->deferred) {
+        kit__LineCmd *c = kit__push_cmd(ctx, KIT__CMD_LINE, sizeof(*c), bounds);
+        c->color = color;
+        c->x1 = x1; c->y1 = y1;
+        c->x2 = x2; c->y2 = y2;
+        return;
+    }
+    kit__raster_line(ctx, bounds, color, x1, y1, x2, y2);
+}
+
+
+void kit_draw_image(kit_Context *ctx, kit_Image *img, int x, int y) {
+    kit_Rect dst = kit_rect(x, y, img->w, img->h);
+    kit_Rect src = kit_rect(0, 0, img->w, img->h);
+    kit_draw_image3(ctx, KIT_WHITE, KIT_BLACK, img, dst, src);
+}
+
+
+void kit_draw_image2(kit_Context *ctx, kit_Color color, kit_Image *img, int x, int y, kit_Rect src) {
+    kit_Rect dst = kit_rect(x, y, abs(src.w), abs(src.h));
+    kit_draw_image3(ctx, color, KIT_BLACK, img, dst, src);
+}
+
+
+void kit_draw_image3(kit_Context *ctx, kit_Color mul_color, kit_Color add_color, kit_Image *img, kit_Rect dst, kit_Rect src) {
+    // early exit on zero-sized anything
+    if (!src.w || !src.h || !dst.w || !dst.h) {
+        return;
+    }
+    kit_Rect bounds = dst;
+    if (!kit__begin_draw(ctx, &bounds)) { return; }
+    KIT__PROF_COUNT(ctx, image_pixels[kit__blend_op(mul_color, add_color)], kit__rect_area(bounds));
+    mul_color = kit__premultiply(mul_color);
+    if (ctx->deferred) {
+        kit__ImageCmd *c = kit__push_cmd(ctx, KIT__CMD_IMAGE, sizeof(*c), bounds);
+        c->mul_color = mul_color;
+        c->add_color = add_color;
+        c->img = img;
+        c->dst = dst;
+        c->src = src;
+        return;
+    }
+    kit__raster_image(ctx, bounds, mul_color, add_color, img, dst, src);
+}
+
+
+void kit_draw_rle_image(kit_Context *ctx, kit_Color mul_color, kit_Color add_color, kit_RleImage *img, int x, int y, kit_Rect src) {
+    // keep src inside the image, shifting the destination to match
+    kit_Rect s = kit__intersect_rects(src, kit_rect(0, 0, img->image->w, img->image->h));
+    x += s.x - src.x;
+    y += s.y - src.y;
+    kit_Rect bounds = kit_rect(x, y, s.w, s.h);
+    if (!kit__begin_draw(ctx, &bounds)) { return; }
+    KIT__PROF_COUNT(ctx, image_pixels[kit__blend_op(mul_color, add_color)], kit__rect_area(bounds));
+    mul_color = kit__premultiply(mul_color);
+    if (ctx->deferred) {
+        kit__RleCmd *c = kit__push_cmd(ctx, KIT__CMD_RLE, sizeof(*c), bounds);
+        c->mul_color = mul_color;
+        c->add_color = add_color;
+        c->img = img;
+        c->x = x; c->y = y;
+        c->src = s;
+        return;
+    }
+    kit__raster_rle(ctx, bounds, mul_color, add_color, img, x, y, s);
+}
+
+
+// draws many parts of one image in a single call. every instance is kept
+// inside the image and culled against the clip rect before anything is
+// drawn; flipped (negative size) src rects draw nothing
+void kit_draw_sprites(kit_Context *ctx, kit_Image *img, kit_Sprite *sprites, int count) {
+    KIT__PROF_COUNT(ctx, draw_calls, 1);
+    kit_Rect image = kit_rect(0, 0, img->w, img->h);
+    for (int i = 0; i < count;) {
+        // cull into the tail of the command buffer, or a stack chunk when
+        // drawing straight away
+        kit_Sprite chunk[64];
+        int n = kit_min(count - i, ctx->deferred ? KIT__SPRITES_PER_CMD : 64);
+        kit__SpritesCmd *c = NULL;
+        kit_Sprite *out = chunk;
+        if (ctx->deferred) {
+            c = kit__reserve_cmd(ctx, sizeof(*c) + n * sizeof(kit_Sprite));
+            out = c->sprites;
+        }
+
+        int visible = 0;
+        kit_Rect bounds = {0};
+        for (; n > 0; n--, i++) {
+            kit_Sprite s = sprites[i];
+            s.src = kit__intersect_rects(s.src, image);
+            s.x += s.src.x - sprites[i].src.x;
+            s.y += s.src.y - sprites[i].src.y;
+            kit_Rect dst = kit_rect(s.x, s.y, s.src.w, s.src.h);
+            kit_Rect r = kit__intersect_rects(dst, ctx->clip);
+            KIT__PROF_COUNT(ctx, clipped_pixels, kit__rect_area(dst) - kit__rect_area(r));
+            if (r.w <= 0 || r.h <= 0) { continue; }
+            s.mul = s.mul.w ? kit__premultiply(s.mul) : KIT_WHITE;
+            KIT__PROF_COUNT(ctx, image_pixels[kit__blend_op(s.mul, s.add)], kit__rect_area(r));
+            bounds = visible ? kit__merge_rects(bounds, r) : r;
+            out[visible++] = s;
+        }
+        if (!visible) { continue; }
+
+        kit__add_dirty(ctx, bounds);
+        if (ctx->deferred) {
+            c->img = img;
+            c->count = visible;
+            kit__push_cmd(ctx, KIT__CMD_SPRITES, sizeof(*c) + visible * sizeof(kit_Sprite), bounds);
+            continue;
+        }
+        for (int j = 0; j < visible; j++) {
+            kit__raster_sprite(ctx, ctx->clip, img, &chunk[j]);
+        }
+    }
+}
+
+
+// draws the `src` part of `img` through the 2x3 matrix `m`: the point u, v of
+// src (0, 0 being its top-left corner) lands on screen at
+// m[0] * u + m[1] * v + m[2], m[3] * u + m[4] * v + m[5]. each pixel whose
+// centre maps inside src takes the nearest texel
+void kit_draw_image_affine(kit_Context *ctx, kit_Color mul_color, kit_Color add_color, kit_Image *img, kit_Rect src, float *m) {
+    kit_Rect s = kit__intersect_rects(src, kit_rect(0, 0, img->w, img->h));
+    if (s.w <= 0 || s.h <= 0) { return; }
+
+    // inverse of the linear part; skip draws that collapse below a pixel
+    double det = (double) m[0] * m[4] - (double) m[1] * m[3];
+    if (!(fabs(det) > 1e-12)) { return; }
+    double inv[4] = { m[4] / det, -m[1] / det, -m[3] / det, m[0] / det };
+    for (int i = 0; i < 4; i++) {
+        if (!(fabs(inv[i]) < 0x4000)) { return; }
+    }
+
+    // screen bounds of the sampled rect's corners
+    double x1 = 1e30, y1 = 1e30, x2 = -1e30, y2 = -1e30;
+    for (int i = 0; i < 4; i++) {
+        double u = s.x - src.x + (i & 1 ? s.w : 0);
+        double v = s.y - src.y + (i & 2 ? s.h : 0);
+        double x = m[0] * u + m[1] * v + m[2];
+        double y = m[3] * u + m[4] * v + m[5];
+        x1 = fmin(x1, x); x2 = fmax(x2, x);
+        y1 = fmin(y1, y); y2 = fmax(y2, y);
+    }
+    if (!(x1 < 0x20000000 && y1 < 0x20000000 && x2 > -0x20000000 && y2 > -0x20000000)) { return; }
+    x1 = floor(fmax(x1, -0x20000000)); x2 = ceil(fmin(x2, 0x20000000));
+    y1 = floor(fmax(y1, -0x20000000)); y2 = ceil(fmin(y2, 0x20000000));
+    kit_Rect bounds = kit_rect((int) x1, (int) y1, (int) (x2 - x1), (int) (y2 - y1));
+    if (!kit__begin_draw(ctx, &bounds)) { return; }
+    KIT__PROF_COUNT(ctx, image_pixels[kit__blend_op(mul_color, add_color)], kit__rect_area(bounds));
+    mul_color = kit__premultiply(mul_color);
+
+    // texel coordinates of the first pixel centre, and their steps
+    double x = bounds.x + 0.5 - m[2], y = bounds.y + 0.5 - m[5];
+    kit__Affine t;
+    t.u = (int64_t) floor((src.x + inv[0] * x + inv[1] * y) * 65536 + 0.5);
+    t.v = (int64_t) floor((src.y + inv[2] * x + inv[3] * y) * 65536 + 0.5);
+    t.du_dx = (int32_t) floor(inv[0] * 65536 + 0.5);
+    t.du_dy = (int32_t) floor(inv[1] * 65536 + 0.5);
+    t.dv_dx = (int32_t) floor(inv[2] * 65536 + 0.5);
+    t.dv_dy = (int32_t) floor(inv[3] * 65536 + 0.5);
+
+    if (ctx->deferred) {
+        kit__AffineCmd *c = kit__push_cmd(ctx, KIT__CMD_AFFINE, sizeof(*c), bounds);
+        c->mul_color = mul_color;
+        c->add_color = add_color;
+        c->img = img;
+        c->src = s;
+        c->t = t;
+        return;
+    }
+    kit__raster_affine(ctx, bounds, mul_color, add_color, img, s, bounds, &t);
+}
+
+
+int kit_draw_text(kit_Context *ctx, kit_Color color, char *text, int x, int y) {
+    return kit_draw_text2(ctx, color, ctx->font, text, x, y);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Text cache
+//////////////////////////////////////////////////////////////////////////////
+
+// each font keeps an lru of strings it has drawn. a string gets an entry the
+// first time it is seen and a composited strip of its glyphs the second
+// time, so one-off strings never pay for compositing. strips hold untinted
+// glyph texels and are drawn with the text color like the glyphs would be,
+// so one strip serves every color and the output is unchanged
+
+enum { KIT__TEXT_SEEN, KIT__TEXT_READY, KIT__TEXT_TOO_BIG };
+
+typedef struct kit__TextEntry kit__TextEntry;
+
+struct kit__TextEntry {
+    kit__TextEntry *prev, *next; // lru order, most recent first
+    kit__TextEntry *chain;       // hash bucket
+    uint32_t hash;
+    int len, width, size, state;
+    kit_Image *image;
+    char text[];
+};
+
+typedef struct kit__TextCache {
+    kit__TextEntry *buckets[256];
+    kit__TextEntry *head, *tail;
+    int budget, bytes, hits, misses;
+} kit__TextCache;
+
+
+static void kit__text_cache_remove(kit__TextCache *c, kit__TextEntry *e) {
+    kit__TextEntry **p = &c->buckets[e->hash & 0xff];
+    while (*p != e) { p = &(*p)->chain; }
+    *p = e->chain;
+    if (e->prev) { e->prev->next = e->next; } else { c->head = e->next; }
+    if (e->next) { e->next->prev = e->prev; } else { c->tail = e->prev; }
+    c->bytes -= e->size;
+    if (e->image) { kit_destroy_image(e->image); }
+    free(e);
+}
+
+
+static void kit__text_cache_trim(kit__TextCache *c, int budget) {
+    while (c->tail && c->bytes > budget) {
+        kit__text_cache_remove(c, c->tail);
+    }
+}
+
+
+static kit__TextCache* kit__text_cache_create(kit_Font *font, int budget) {
+    if (!font->cache) {
+        font->cache = kit__alloc(sizeof(kit__TextCache));
+    }
+    font->cache->budget = budget;
+    return font->cache;
+}
+
+
+// strips still queued in ctx's command buffer are drawn before any are freed
+void kit_set_text_cache(kit_Context *ctx, kit_Font *font, int budget) {
+    kit__TextCache *c = kit__text_cache_create(font, budget);
+    if (c->bytes > budget) {
+        kit_flush(ctx);
+        kit__text_cache_trim(c, budget);
+    }
+}
+
+
+// like kit_set_text_cache(), flushes ctx before freeing anything
+void kit_clear_text_cache(kit_Context *ctx, kit_Font *font) {
+    if (font->cache && font->cache->head) {
+        kit_flush(ctx);
+        kit__text_cache_trim(font->cache, 0);
+    }
+}
+
+
+void kit_text_cache_stats(kit_Font *font, int *hits, int *misses, int *bytes) {
+    kit__TextCache *c = font->cache;
+    if (hits)   { *hits   = c ? c->hits   : 0; }
+    if (misses) { *misses = c ? c->misses : 0; }
+    if (bytes)  { *bytes  = c ? c->bytes  : 0; }
+}
+
+
+static kit_Image* kit__composite_text(kit_Font *font, char *text, int *width) {
+    // size the strip
+    int x = 0, w = 0, h = 0;
+    for (uint8_t *p = (void*) text; *p; p++) {
+        kit_Glyph g = font->glyphs[*p];
+        if (x < 0 || g.rect.w < 0 || g.rect.h < 0) { return NULL; }
+        w = kit_max(w, x + g.rect.w);
+        h = kit_max(h, g.rect.h);
+        x += g.xadv;
+    }
+    *width = x;
+    if (w == 0 || h == 0) { return NULL; }
+
+    // copy each glyph's visible texels into place
+    kit_Image *img = kit_create_image(w, h);
+    x = 0;
+    for (uint8_t *p = (void*) text; *p; p++) {
+        kit_Glyph g = font->glyphs[*p];
+        for (int y = 0; y < g.rect.h; y++) {
+            kit_Color *s = &font->image->pixels[g.rect.x + (g.rect.y + y) * font->image->w];
+            kit_Color *d = &img->pixels[x + y * w];
+            for (int i = 0; i < g.rect.w; i++) {
+                if (s[i].a) { d[i] = s[i]; }
+            }
+        }
+        x += g.xadv;
+    }
+    return img;
+}
+
+
+// returns the entry for `text` if it has a strip (or is known to be empty)
+static kit__TextEntry* kit__text_cache_get(kit_Context *ctx, kit_Font *font, char *text) {
+    kit__TextCache *c = font->cache ? font->cache : kit__text_cache_create(font, KIT_TEXT_CACHE_SIZE);
+    if (c->budget <= 0) { return NULL; }
+
+    uint32_t hash = 2166136261u;
+    int len = 0;
+    for (uint8_t *p = (void*) text; *p; p++, len++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+
+    kit__TextEntry *e = c->buckets[hash & 0xff];
+    while (e && (e->hash != hash || e->len != len || memcmp(e->text, text, len))) {
+        e = e->chain;
+    }
+
+    if (!e) {
+        // first sighting: remember the string, draw it glyph by glyph
+        c->misses++;
+        int size = sizeof(kit__TextEntry) + len + 1;
+        if (size > c->budget) { return NULL; }
+        e = kit__alloc(size);
+        e->hash = hash;
+        e->len = len;
+        e->size = size;
+        memcpy(e->text, text, len);
+        e->chain = c->buckets[hash & 0xff];
+        c->buckets[hash & 0xff] = e;
+        c->bytes += size;
+
+    } else {
+        // unlink, it is moved to the front below
+        if (e->prev) { e->prev->next = e->next; } else { c->head = e->next; }
+        if (e->next) { e->next->prev = e->prev; } else { c->tail = e->prev; }
+
+        if (e->state == KIT__TEXT_SEEN) {
+            c->misses++;
+            kit_Image *img = kit__composite_text(font, text, &e->width);
+            int n = img ? img->w * img->h * sizeof(kit_Color) : 0;
+            if (e->size + n > c->budget) {
+                if (img) { kit_destroy_image(img); }
+                e->state = KIT__TEXT_TOO_BIG;
+            } else {
+                e->image = img;
+                e->size += n;
+                c->bytes += n;
+                e->state = KIT__TEXT_READY;
+            }
+        } else if (e->state == KIT__TEXT_READY) {
+            c->hits++;
+        } else {
+            c->misses++;
+        }
+    }
+
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head) { c->head->prev = e; } else { c->tail = e; }
+    c->head = e;
+
+    // `e` fits the budget so it survives; strips still queued in the command
+    // buffer have to be drawn before they can be evicted
+    if (c->bytes > c->budget) {
+        kit_flush(ctx);
+        kit__text_cache_trim(c, c->budget);
+    }
+
+    return e->state == KIT__TEXT_READY ? e : NULL;
+}
+
+
+int kit_draw_text2(kit_Context *ctx, kit_Color color, kit_Font *font, char *text, int x, int y) {
+    kit__TextEntry *e = kit__text_cache_get(ctx, font, text);
+    if (e) {
+        if (e->image) {
+            kit_draw_image2(ctx, color, e->image, x, y, kit_rect(0, 0, e->image->w, e->image->h));
+        }
+        return x + e->width;
+    }
+    for (uint8_t *p = (void*) text; *p; p++) {
+        kit_Glyph g = font->glyphs[*p];
+        kit_draw_image2(ctx, color, font->image, x, y, g.rect);
+        x += g.xadv;
+    }
+    return x;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Batch loading
+//////////////////////////////////////////////////////////////////////////////
+
+// workers claim assets through an atomic counter and append each one to
+// `order` as it finishes. `lock` is a semaphore holding one token, and
+// `ready` is posted once per finished asset so waiters can sleep
+
+struct kit__Batch {
+    kit_Asset *assets;
+    int count;
+    volatile long next;
+    int *order;
+    int finished, failed, returned;
+    kit__Sem lock, ready;
+    int thread_count;
+    kit__Thread *threads;
+};
+
+
+static void kit__batch_worker(void *arg) {
+    kit_Batch *b = arg;
+    for (;;) {
+        int i = kit__atomic_inc(&b->next) - 1;
+        if (i >= b->count) { break; }
+        kit_Asset *a = &b->assets[i];
+        double t = kit__now();
+        if (a->type == KIT_ASSET_FONT) {
+            a->result = kit_load_font_file(a->filename);
+        } else {
+            a->result = kit_load_image_file(a->filename);
+        }
+        a->time = kit__now() - t;
+
+        kit__sem_wait(&b->lock);
+        b->order[b->finished++] = i;
+        if (!a->result) { b->failed++; }
+        kit__sem_post(&b->lock, 1);
+        kit__sem_post(&b->ready, 1);
+    }
+}
+
+
+// starts loading `assets` on `threads` workers (0 for one per core). the
+// array must outlive the batch; results belong to the caller
+kit_Batch* kit_load_batch(kit_Asset *assets, int count, int threads) {
+    kit_Batch *b = kit__alloc(sizeof(kit_Batch));
+    b->assets = assets;
+    b->count = count;
+    b->order = kit__alloc(kit_max(count, 1) * sizeof(int));
+    kit__sem_init(&b->lock);
+    kit__sem_init(&b->ready);
+    kit__sem_post(&b->lock, 1);
+
+    for (int i = 0; i < count; i++) {
+        assets[i].result = NULL;
+        assets[i].time = 0;
+    }
+    if (threads <= 0) { threads = kit__cpu_count(); }
+    b->thread_count = kit_max(kit_min(threads, count), 0);
+    b->threads = kit__alloc(kit_max(b->thread_count, 1) * sizeof(kit__Thread));
+    for (int i = 0; i < b->thread_count; i++) {
+        kit__start_thread(&b->threads[i], kit__batch_worker, b);
+    }
+    return b;
+}
+
+
+// next finished asset in completion order, or NULL if none is ready yet
+kit_Asset* kit_batch_poll(kit_Batch *b) {
+    kit_Asset *res = NULL;
+    kit__sem_wait(&b->lock);
+    if (b->returned < b->finished) { res = &b->assets[b->order[b->returned++]]; }
+    kit__sem_post(&b->lock, 1);
+    return res;
+}
+
+
+// like kit_batch_poll() but blocks; NULL once every asset has been returned
+kit_Asset* kit_batch_wait(kit_Batch *b) {
+    for (;;) {
+        kit_Asset *res = kit_batch_poll(b);
+        if (res || b->returned == b->count) { return res; }
+        // assets taken by kit_batch_poll() leave stale posts behind, so
+        // waking up doesn't guarantee one is ready
+        kit__sem_wait(&b->ready);
+    }
+}
+
+
+void kit_batch_stats(kit_Batch *b, int *finished, int *failed) {
+    kit__sem_wait(&b->lock);
+    if (finished) { *finished = b->finished; }
+    if (failed)   { *failed   = b->failed; }
+    kit__sem_post(&b->lock, 1);
+}
+
+
+// waits for loads still in flight; loaded assets are not freed
+void kit_destroy_batch(kit_Batch *b) {
+    for (int i = 0; i < b->thread_count; i++) {
+        kit__join_thread(b->threads[i]);
+    }
+    kit__sem_destroy(&b->lock);
+    kit__sem_destroy(&b->ready);
+    free(b->threads);
+    free(b->order);
+    free(b);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Asset packs
+//////////////////////////////////////////////////////////////////////////////
+
+// a pack holds images and fonts already decoded, and is used in place. it is
+// written by the packer in pack/; fields are native little-endian and
+// offsets count from the start of the pack:
+//
+//   kit__PackHeader
+//   kit__PackEntry entries[count]
+//   uint32_t slots[slot_count]  name index: linear probing on the name's
+//                               hash, holding entry + 1, or 0 if empty
+//   names, glyph tables and 64-byte aligned kit_Color pixels
+//
+// images point straight at the pixels, so nothing is decoded or copied when
+// a pack is opened; fonts only copy their glyph table
+
+#define KIT__PACK_MAGIC   0x7074696b // "kitp"
+#define KIT__PACK_VERSION 1
+
+// packs are only read by builds with the same pixel format
+#ifdef KIT_PREMULTIPLIED
+#define KIT__PACK_FLAGS 1
+#else
+#define KIT__PACK_FLAGS 0
+#endif
+
+typedef struct {
+    uint32_t magic, version, flags;
+    uint32_t count, slot_count; // slot_count is a power of two above count
+} kit__PackHeader;
+
+typedef struct {
+    uint32_t hash;    // kit__pack_hash() of the name
+    uint32_t name;    // nul-terminated
+    int32_t type;     // KIT_ASSET_IMAGE or KIT_ASSET_FONT
+    int32_t w, h;
+    uint32_t pixels;  // w * h kit_Colors
+    uint32_t glyphs;  // 256 kit_Glyphs, fonts only
+    uint32_t reserved;
+} kit__PackEntry;
+
+struct kit__Pack {
+    uint8_t *data;
+    size_t len;
+    bool mapped;
+    kit__PackHeader *header;
+    kit__PackEntry *entries;
+    uint32_t *slots;
+    kit_Image *images;  // one per entry
+    kit_Font **fonts;   // one per entry, NULL for images
+};
+
+
+static uint32_t kit__pack_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const uint8_t *p = (const void*) name; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+
+static bool kit__pack_span(kit_Pack *p, uint64_t offset, uint64_t size) {
+    return offset <= p->len && size <= p->len - offset;
+}
+
+
+// every offset is checked when the pack is opened so lookups can trust it
+static bool kit__pack_check(kit_Pack *p) {
+    kit__PackHeader *h = p->header;
+    if (!kit__pack_span(p, 0, sizeof(*h))) { return false; }
+    if (h->magic != KIT__PACK_MAGIC || h->version != KIT__PACK_VERSION || h->flags != KIT__PACK_FLAGS) { return false; }
+    if (h->count > (1 << 24) || h->slot_count <= h->count || (h->slot_count & (h->slot_count - 1))) { return false; }
+    uint64_t size = (uint64_t) h->count * sizeof(kit__PackEntry) + (uint64_t) h->slot_count * sizeof(uint32_t);
+    if (!kit__pack_span(p, sizeof(*h), size)) { return false; }
+    p->entries = (void*) (h + 1);
+    p->slots = (void*) (p->entries + h->count);
+
+    for (uint32_t i = 0; i < h->count; i++) {
+        kit__PackEntry *e = &p->entries[i];
+        if (e->type != KIT_ASSET_IMAGE && e->type != KIT_ASSET_FONT) { return false; }
+        if (e->w <= 0 || e->h <= 0 || e->w > (1 << 24) || e->w > (1 << 28) / e->h) { return false; }
+        if ((e->pixels & 3) || !kit__pack_span(p, e->pixels, (uint64_t) e->w * e->h * sizeof(kit_Color))) { return false; }
+        if (e->type == KIT_ASSET_FONT) {
+            if ((e->glyphs & 3) || !kit__pack_span(p, e->glyphs, 256 * sizeof(kit_Glyph))) { return false; }
+            // text drawing trusts glyph rects, so each has to lie in the image
+            kit_Glyph *g = (void*) (p->data + e->glyphs);
+            for (int j = 0; j < 256; j++) {
+                kit_Rect r = g[j].rect;
+                if (r.x < 0 || r.y < 0 || r.w < 0 || r.h < 0) { return false; }
+                if (r.x > e->w - r.w || r.y > e->h - r.h) { return false; }
+            }
+        }
+        if (e->name >= p->len || !memchr(p->data + e->name, '\0', p->len - e->name)) { return false; }
+    }
+
+    // probing stops at an empty slot, so there has to be one
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < h->slot_count; i++) {
+        if (p->slots[i] > h->count) { return false; }
+        used += !!p->slots[i];
+    }
+    return used <= h->count;
+}
+
+
+// maps the pack for the life of the kit_Pack; NULL if it isn't a valid pack
+kit_Pack* kit_open_pack(char *filename) {
+    size_t len;
+    void *data = kit_map_file(filename, &len);
+    if (!data) { return NULL; }
+    kit_Pack *p = kit_open_pack_mem(data, len);
+    if (p) {
+        p->mapped = true;
+    } else {
+        kit_unmap_file(data, len);
+    }
+    return p;
+}
+
+
+// `data` must be 4-byte aligned and outlive the pack
+kit_Pack* kit_open_pack_mem(void *data, size_t len) {
+    if ((uintptr_t) data & 3) { return NULL; }
+    kit_Pack *p = kit__alloc(sizeof(kit_Pack));
+    p->data = data;
+    p->len = len;
+    p->header = data;
+    if (!kit__pack_check(p)) {
+        free(p);
+        return NULL;
+    }
+
+    int count = p->header->count;
+    p->images = kit__alloc(kit_max(count, 1) * sizeof(kit_Image));
+    p->fonts = kit__alloc(kit_max(count, 1) * sizeof(kit_Font*));
+    for (int i = 0; i < count; i++) {
+        kit__PackEntry *e = &p->entries[i];
+        p->images[i] = (kit_Image) { (void*) (p->data + e->pixels), e->w, e->h };
+        if (e->type == KIT_ASSET_FONT) {
+            kit_Font *font = kit__alloc(sizeof(kit_Font));
+            font->image = &p->images[i];
+            memcpy(font->glyphs, p->data + e->glyphs, sizeof(font->glyphs));
+            p->fonts[i] = font;
+        }
+    }
+    return p;
+}
+
+
+// images and fonts from the pack go with it; flush first if any are queued
+void kit_close_pack(kit_Pack *p) {
+    for (uint32_t i = 0; i < p->header->count; i++) {
+        kit_Font *font = p->fonts[i];
+        if (!font) { continue; }
+        if (font->cache) { kit__text_cache_trim(font->cache, 0); }
+        free(font->cache);
+        free(font);
+    }
+    if (p->mapped) { kit_unmap_file(p->data, p->len); }
+    free(p->images);
+    free(p->fonts);
+    free(p);
+}
+
+
+static int kit__pack_find(kit_Pack *p, char *name) {
+    uint32_t hash = kit__pack_hash(name);
+    uint32_t mask = p->header->slot_count - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        uint32_t slot = p->slots[i];
+        if (!slot) { return -1; }
+        kit__PackEntry *e = &p->entries[slot - 1];
+        if (e->hash == hash && !strcmp((char*) p->data + e->name, name)) { return slot - 1; }
+    }
+}
+
+
+// the image (or a font's glyph sheet) called `name`, or NULL. its pixels are
+// the pack's, read-only when the pack is mapped, and it must not be
+// destroyed
+kit_Image* kit_pack_image(kit_Pack *p, char *name) {
+    int i = kit__pack_find(p, name);
+    return i < 0 ? NULL : &p->images[i];
+}
+
+
+// the font called `name`, or NULL; owned by the pack like its images
+kit_Font* kit_pack_font(kit_Pack *p, char *name) {
+    int i = kit__pack_find(p, name);
+    return i < 0 ? NULL : p->fonts[i];
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Atlas
+//////////////////////////////////////////////////////////////////////////////
+
+// images are copied into w x h pages, each packed bottom-left against a
+// skyline: the top edge of everything placed so far, kept as left-to-right
+// segments. every segment is at least a pixel wide, so a page never needs
+// more than w of them
+
+typedef struct { int x, y, w; } kit__Skyline;
+
+typedef struct {
+    kit_Image *image;
+    kit__Skyline *sky;
+    int count;
+} kit__AtlasPage;
+
+struct kit__Atlas {
+    int w, h;
+    kit__AtlasPage *pages;
+    int page_count;
+    int64_t used;
+};
+
+
+// y at which a w x h rect starting at segment `i` rests, or -1 if it doesn't
+// fit on the page there
+static int kit__skyline_fit(kit__AtlasPage *p, int i, int w, int h) {
+    int x0 = p->sky[i].x, y = 0;
+    if (x0 + w > p->image->w) { return -1; }
+    for (int x = x0; x < x0 + w; i++) {
+        y = kit_max(y, p->sky[i].y);
+        if (y + h > p->image->h) { return -1; }
+        x = p->sky[i].x + p->sky[i].w;
+    }
+    return y;
+}
+
+
+static void kit__skyline_remove(kit__AtlasPage *p, int i) {
+    memmove(&p->sky[i], &p->sky[i + 1], (p->count - i - 1) * sizeof(kit__Skyline));
+    p->count--;
+}
+
+
+// raises the skyline over the rect placed at segment `i`
+static void kit__skyline_insert(kit__AtlasPage *p, int i, int y, int w, int h) {
+    kit__Skyline seg = { p->sky[i].x, y + h, w };
+    int end = seg.x + w;
+
+    // segments wholly under the rect go, one sticking out is shortened
+    int j = i;
+    while (j < p->count && p->sky[j].x + p->sky[j].w <= end) { j++; }
+    if (j < p->count && p->sky[j].x < end) {
+        p->sky[j].w -= end - p->sky[j].x;
+        p->sky[j].x = end;
+    }
+    memmove(&p->sky[i + 1], &p->sky[j], (p->count - j) * sizeof(kit__Skyline));
+    p->count += 1 - (j - i);
+    p->sky[i] = seg;
+
+    if (i + 1 < p->count && p->sky[i + 1].y == seg.y) {
+        p->sky[i].w += p->sky[i + 1].w;
+        kit__skyline_remove(p, i + 1);
+    }
+    if (i > 0 && p->sky[i - 1].y == seg.y) {
+        p->sky[i - 1].w += p->sky[i].w;
+        kit__skyline_remove(p, i);
+    }
+}
+
+
+kit_Atlas* kit_create_atlas(int w, int h) {
+    kit__expect(w > 0 && h > 0);
+    kit_Atlas *a = kit__alloc(sizeof(kit_Atlas));
+    a->w = w;
+    a->h = h;
+    return a;
+}
+
+
+// pages still queued in the command buffer must be flushed first
+void kit_destroy_atlas(kit_Atlas *a) {
+    for (int i = 0; i < a->page_count; i++) {
+        kit_destroy_image(a->pages[i].image);
+        free(a->pages[i].sky);
+    }
+    free(a->pages);
+    free(a);
+}
+
+
+// copies `img` into the first page with room, starting a new one if none
+// has, and returns that page with `rect` set to the copy; draw it with
+// kit_draw_image2() / kit_draw_image3(). NULL if `img` is bigger than a page.
+// adding the tallest images first packs tightest
+kit_Image* kit_atlas_add(kit_Atlas *a, kit_Image *img, kit_Rect *rect) {
+    if (img->w > a->w || img->h > a->h) { return NULL; }
+
+    // lowest top edge wins, then the narrowest segment
+    kit__AtlasPage *p = NULL;
+    int best = -1, best_y = 0, best_top = INT32_MAX, best_w = INT32_MAX;
+    for (int k = 0; k < a->page_count && best < 0; k++) {
+        p = &a->pages[k];
+        for (int i = 0; i < p->count; i++) {
+            int y = kit__skyline_fit(p, i, img->w, img->h);
+            if (y < 0) { continue; }
+            if (y + img->h < best_top || (y + img->h == best_top && p->sky[i].w < best_w)) {
+                best = i;
+                best_y = y;
+                best_top = y + img->h;
+                best_w = p->sky[i].w;
+            }
+        }
+    }
+
+    if (best < 0) {
+        a->pages = realloc(a->pages, (a->page_count + 1) * sizeof(kit__AtlasPage));
+        if (!a->pages) { kit__panic("out of memory"); }
+        p = &a->pages[a->page_count++];
+        p->image = kit_create_image(a->w, a->h);
+        p->sky = kit__alloc(a->w * sizeof(kit__Skyline));
+        p->sky[0] = (kit__Skyline) { 0, 0, a->w };
+        p->count = 1;
+        best = 0;
+        best_y = 0;
+    }
+
+    *rect = kit_rect(p->sky[best].x, best_y, img->w, img->h);
+    kit__skyline_insert(p, best, best_y, img->w, img->h);
+    for (int y = 0; y < img->h; y++) {
+        memcpy(&p->image->pixels[rect->x + (rect->y + y) * a->w], &img->pixels[y * img->w], img->w * sizeof(kit_Color));
+    }
+    a->used += img->w * img->h;
+    return p->image;
+}
+
+
+// `occupancy` is the fraction of page area holding images
+void kit_atlas_stats(kit_Atlas *a, int *pages, double *occupancy) {
+    if (pages)     { *pages     = a->page_count; }
+    if (occupancy) { *occupancy = a->page_count ? (double) a->used / ((double) a->w * a->h * a->page_count) : 0; }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Tilemaps
+//////////////////////////////////////////////////////////////////////////////
+
+// a map is cut into chunks of KIT_CHUNK_TILES x KIT_CHUNK_TILES tiles. the
+// first time a chunk is on screen all of its layers are composited into one
+// image, and after that drawing it is a single blit until one of its tiles
+// changes. chunks that haven't been drawn lately are dropped once the cache
+// grows past KIT_TILEMAP_CACHE_SIZE bytes
+
+typedef struct {
+    kit_Image *image; // NULL if every tile in the chunk is empty
+    bool ready;       // false until composited, and again after an edit
+    uint32_t used;    // draw stamp of the last kit_draw_tilemap() to show it
+} kit__Chunk;
+
+struct kit__Tilemap {
+    kit_Image *sheet;
+    int tile_w, tile_h, sheet_tiles;
+    int w, h, layers;
+    uint16_t *tiles;
+    kit__Chunk *chunks;
+    int chunks_w, chunks_h;
+    int bytes;
+    uint32_t stamp;
+};
+
+
+// source-over onto a pixel that may itself be transparent. opaque and fully
+// transparent texels come out exactly as if the layers were drawn one by one
+static inline kit_Color kit__composite_pixel(kit_Color d, kit_Color s) {
+    if (s.a == 0xff || d.a == 0) { return s; }
+    if (s.a == 0) { return d; }
+#ifdef KIT_PREMULTIPLIED
+    kit_Color r = kit__blend_pixel(d, s);
+    r.a = s.a + ((d.a * (0x100 - s.a)) >> 8);
+    return r;
+#else
+    int da = d.a * (0xff - s.a) / 0xff;
+    int a = s.a + da;
+    kit_Color r;
+    r.r = (s.r * s.a + d.r * da) / a;
+    r.g = (s.g * s.a + d.g * da) / a;
+    r.b = (s.b * s.a + d.b * da) / a;
+    r.a = a;
+    return r;
+#endif
+}
+
+
+static void kit__composite_chunk(kit_Tilemap *m, int cx, int cy, kit__Chunk *c) {
+    int tx1 = cx * KIT_CHUNK_TILES, tx2 = kit_min(tx1 + KIT_CHUNK_TILES, m->w);
+    int ty1 = cy * KIT_CHUNK_TILES, ty2 = kit_min(ty1 + KIT_CHUNK_TILES, m->h);
+    int cols = m->sheet->w / m->tile_w;
+
+    // chunks with nothing to draw don't get an image
+    bool empty = true;
+    for (int l = 0; l < m->layers && empty; l++) {
+        for (int ty = ty1; ty < ty2 && empty; ty++) {
+            for (int tx = tx1; tx < tx2; tx++) {
+                int t = m->tiles[tx + (ty + l * m->h) * m->w];
+                if (t && t <= m->sheet_tiles) { empty = false; break; }
+            }
+        }
+    }
+    if (c->image) {
+        m->bytes -= c->image->w * c->image->h * sizeof(kit_Color);
+        kit_destroy_image(c->image);
+        c->image = NULL;
+    }
+    c->ready = true;
+    if (empty) { return; }
+
+    kit_Image *img = kit_create_image((tx2 - tx1) * m->tile_w, (ty2 - ty1) * m->tile_h);
+    m->bytes += img->w * img->h * sizeof(kit_Color);
+    c->image = img;
+    for (int l = 0; l < m->layers; l++) {
+        for (int ty = ty1; ty < ty2; ty++) {
+            for (int tx = tx1; tx < tx2; tx++) {
+                int t = m->tiles[tx + (ty + l * m->h) * m->w] - 1;
+                if (t < 0 || t >= m->sheet_tiles) { continue; }
+                kit_Color *s = &m->sheet->pixels[(t % cols) * m->tile_w + (t / cols) * m->tile_h * m->sheet->w];
+                kit_Color *d = &img->pixels[(tx - tx1) * m->tile_w + (ty - ty1) * m->tile_h * img->w];
+                for (int y = 0; y < m->tile_h; y++) {
+                    for (int x = 0; x < m->tile_w; x++) {
+                        d[x] = kit__composite_pixel(d[x], s[x]);
+                    }
+                    s += m->sheet->w;
+                    d += img->w;
+                }
+            }
+        }
+    }
+}
+
+
+// a w x h map of tile_w x tile_h tiles cut from `sheet`, read left to right
+// and top to bottom. tile 0 is empty and tile n is the n-th tile of the sheet,
+// so a fresh map draws nothing. `sheet` must outlive the map
+kit_Tilemap* kit_create_tilemap(kit_Image *sheet, int tile_w, int tile_h, int w, int h, int layers) {
+    kit__expect(tile_w > 0 && tile_h > 0 && w > 0 && h > 0 && layers > 0);
+    kit_Tilemap *m = kit__alloc(sizeof(kit_Tilemap));
+    m->sheet = sheet;
+    m->tile_w = tile_w;
+    m->tile_h = tile_h;
+    m->sheet_tiles = (sheet->w / tile_w) * (sheet->h / tile_h);
+    m->w = w;
+    m->h = h;
+    m->layers = layers;
+    m->tiles = kit__alloc(w * h * layers * sizeof(uint16_t));
+    m->chunks_w = (w + KIT_CHUNK_TILES - 1) / KIT_CHUNK_TILES;
+    m->chunks_h = (h + KIT_CHUNK_TILES - 1) / KIT_CHUNK_TILES;
+    m->chunks = kit__alloc(m->chunks_w * m->chunks_h * sizeof(kit__Chunk));
+    return m;
+}
+
+
+// chunks still queued in the command buffer must be flushed first
+void kit_destroy_tilemap(kit_Tilemap *m) {
+    for (int i = 0; i < m->chunks_w * m->chunks_h; i++) {
+        if (m->chunks[i].image) { kit_destroy_image(m->chunks[i].image); }
+    }
+    free(m->chunks);
+    free(m->tiles);
+    free(m);
+}
+
+
+void kit_set_tile(kit_Tilemap *m, int layer, int x, int y, int tile) {
+    kit__expect(layer >= 0 && layer < m->layers && x >= 0 && x < m->w && y >= 0 && y < m->h);
+    kit__expect(tile >= 0 && tile <= 0xffff);
+    uint16_t *t = &m->tiles[x + (y + layer * m->h) * m->w];
+    if (*t == tile) { return; }
+    *t = tile;
+    m->chunks[x / KIT_CHUNK_TILES + (y / KIT_CHUNK_TILES) * m->chunks_w].ready = false;
+}
+
+
+// 0 (empty) outside the map
+int kit_get_tile(kit_Tilemap *m, int layer, int x, int y) {
+    if (layer < 0 || layer >= m->layers || x < 0 || x >= m->w || y < 0 || y >= m->h) { return 0; }
+    return m->tiles[x + (y + layer * m->h) * m->w];
+}
+
+
+// draws every layer with the map's top-left corner at x, y; only chunks
+// inside the clip rect are touched. to put sprites between layers, split
+// them over two maps
+void kit_draw_tilemap(kit_Context *ctx, kit_Tilemap *m, int x, int y) {
+    int cw = KIT_CHUNK_TILES * m->tile_w;
+    int ch = KIT_CHUNK_TILES * m->tile_h;
+    kit_Rect r = kit__intersect_rects(ctx->clip, kit_rect(x, y, m->w * m->tile_w, m->h * m->tile_h));
+    if (r.w <= 0 || r.h <= 0) { return; }
+    int cx1 = (r.x - x) / cw, cx2 = (r.x + r.w - 1 - x) / cw;
+    int cy1 = (r.y - y) / ch, cy2 = (r.y + r.h - 1 - y) / ch;
+
+    m->stamp++;
+    for (int cy = cy1; cy <= cy2; cy++) {
+        for (int cx = cx1; cx <= cx2; cx++) {
+            kit__Chunk *c = &m->chunks[cx + cy * m->chunks_w];
+            if (!c->ready) {
+                // a stale image may still be queued in the command buffer
+                if (c->image) { kit_flush(ctx); }
+                kit__composite_chunk(m, cx, cy, c);
+            }
+            c->used = m->stamp;
+            if (c->image) { kit_draw_image(ctx, c->image, x + cx * cw, y + cy * ch); }
+        }
+    }
+
+    // evict the least recently drawn chunks, never one drawn just now
+    bool flushed = false;
+    while (m->bytes > KIT_TILEMAP_CACHE_SIZE) {
+        kit__Chunk *oldest = NULL;
+        for (int i = 0; i < m->chunks_w * m->chunks_h; i++) {
+            kit__Chunk *c = &m->chunks[i];
+            if (c->image && c->used != m->stamp && (!oldest || m->stamp - c->used > m->stamp - oldest->used)) {
+                oldest = c;
+            }
+        }
+        if (!oldest) { break; }
+        if (!flushed) { kit_flush(ctx); flushed = true; }
+        m->bytes -= oldest->image->w * oldest->image->h * sizeof(kit_Color);
+        kit_destroy_image(oldest->image);
+        oldest->image = NULL;
+        oldest->ready = false;
+    }
+}
+
+
+// `chunks` is the number of composited chunk images held
+void kit_tilemap_stats(kit_Tilemap *m, int *chunks, int *bytes) {
+    if (chunks) {
+        *chunks = 0;
+        for (int i = 0; i < m->chunks_w * m->chunks_h; i++) { *chunks += !!m->chunks[i].image; }
+    }
+    if (bytes) { *bytes = m->bytes; }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Profiler
+//////////////////////////////////////////////////////////////////////////////
+
+// copies up to `max` of the most recent frames, oldest first
+int kit_profile_frames(kit_Context *ctx, kit_Profile *frames, int max) {
+#ifdef KIT_PROFILE
+    int n = kit_min(max, ctx->prof.count);
+    for (int i = 0; i < n; i++) {
+        int idx = (ctx->prof.head - n + i + KIT_PROFILE_FRAMES) % KIT_PROFILE_FRAMES;
+        frames[i] = ctx->prof.frames[idx];
+    }
+    return n;
+#else
+    return 0;
+#endif
+}
+
+
+// one bar per frame: busy time on top of sleep time, scaled so the frame
+// budget sits at half height. the overlay's own draws are counted as well
+void kit_draw_profile(kit_Context *ctx, int x, int y) {
+#ifdef KIT_PROFILE
+    enum { H = 48 };
+    kit_Profile frames[KIT_PROFILE_FRAMES];
+    int n = kit_profile_frames(ctx, frames, KIT_PROFILE_FRAMES);
+    double budget = ctx->step_time > 0 ? ctx->step_time : 1.0 / 60.0;
+
+    kit_draw_rect(ctx, kit_rgba(0, 0, 0, 0xc0), kit_rect(x, y, KIT_PROFILE_FRAMES + 8, H + 30));
+    int gx = x + 4 + KIT_PROFILE_FRAMES - n;
+    int gy = y + 4 + H;
+    for (int i = 0; i < n; i++) {
+        kit_Profile *f = &frames[i];
+        double busy = f->frame_time - f->sleep_time;
+        int bh = kit_min(H, busy / budget * H / 2);
+        int sh = kit_min(H - bh, f->sleep_time / budget * H / 2);
+        kit_Color c = busy > budget ? kit_rgb(0xe0, 0x40, 0x40) : kit_rgb(0x40, 0xc0, 0x60);
+        kit_draw_rect(ctx, c, kit_rect(gx + i, gy - bh, 1, bh));
+        kit_draw_rect(ctx, kit_rgb(0x50, 0x50, 0x50), kit_rect(gx + i, gy - bh - sh, 1, sh));
+    }
+    kit_draw_line(ctx, kit_rgba(0xff, 0xff, 0xff, 0x60), x + 4, gy - H / 2, x + 3 + KIT_PROFILE_FRAMES, gy - H / 2);
+
+    if (n == 0) { return; }
+    kit_Profile *f = &frames[n - 1];
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.2f ms  %d draws", f->frame_time * 1000, f->draw_calls);
+    kit_draw_text(ctx, KIT_WHITE, buf, x + 4, gy + 2);
+    snprintf(buf, sizeof(buf), "busy %.2f ms", (f->frame_time - f->sleep_time) * 1000);
+    kit_draw_text(ctx, KIT_WHITE, buf, x + 4, gy + 14);
+#endif
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// PNG loader | borrowed from tigr : https://github.com/erkkah/tigr
+//////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    const unsigned char *p, *end;
+} kit__Png;
+
+// Huffman codes are decoded through lookup tables: the low bits of the bit
+// buffer index a primary table, and the rare codes longer than that link to
+// a subtable indexed by the bits that follow.
+#define KIT__INFLATE_LIT_BITS   10
+#define KIT__INFLATE_LIT_SIZE   2048
+#define KIT__INFLATE_DIST_BITS  8
+#define KIT__INFLATE_DIST_SIZE  1024
+#define KIT__INFLATE_LEN_BITS   7
+
+// Inflating stops for the caller once less than a maximum run (plus word
+// copy overshoot) fits in the output; the window is the history that must
+// be kept when the caller slides the output down.
+#define KIT__INFLATE_SLACK      (258 + 8)
+#define KIT__INFLATE_WINDOW     32768
+#define KIT__INFLATE_CHUNK      131072
+
+enum { KIT__INFLATE_ZLIB, KIT__INFLATE_HEADER, KIT__INFLATE_HUFFMAN, KIT__INFLATE_STORED };
+
+typedef struct {
+    uint64_t bits;
+    int count, pad;
+    const unsigned char *in, *inend;
+    unsigned char *out, *outstart, *outend;
+    kit__Png *png;  // source of further IDAT chunks
+    jmp_buf jmp;
+    int mode, last, done, stored, fixed;
+    uint32_t litcodes[KIT__INFLATE_LIT_SIZE];
+    uint32_t distcodes[KIT__INFLATE_DIST_SIZE];
+    uint32_t lencodes[1 << KIT__INFLATE_LEN_BITS];
+} kit__PngState;
+
+
+#define FAIL() longjmp(s->jmp, 1)
+#define CHECK(X) if (!(X)) { FAIL(); }
+
+// Built-in DEFLATE standard tables.
+static char    kit__png_order[]        = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+static char  kit__png_len_bits[29 + 2] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0, 0, 0 };
+static int   kit__png_len_base[29 + 2] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0,  0 };
+static char kit__png_dist_bits[30 + 2] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 0, 0 };
+static int  kit__png_dist_base[30 + 2] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+
+// Table to bit-reverse a byte.
+static const unsigned char kit__png_reverse_table[256] = {
+#define R2(n) n, n + 128, n + 64, n + 192
+#define R4(n) R2(n), R2(n + 32), R2(n + 16), R2(n + 48)
+#define R6(n) R4(n), R4(n + 8), R4(n + 4), R4(n + 12)
+    R6(0), R6(2), R6(1), R6(3)
+};
+#undef R2
+#undef R4
+#undef R6
+
+static unsigned kit__png_rev16(unsigned n) {
+    return (kit__png_reverse_table[n & 0xff] << 8) | kit__png_reverse_table[(n >> 8) & 0xff];
+}
+
+static inline uint64_t kit__png_load64(const unsigned char* p) {
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+#else
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) { v = (v << 8) | p[i]; }
+    return v;
+#endif
+}
+
+static const unsigned char* kit__png_find(kit__Png* png, const char* chunk, unsigned minlen);
+static unsigned kit__png_get32(const unsigned char* v);
+
+// Moves the input on to the next IDAT chunk once the current one is used up.
+static int kit__png_next_input(kit__PngState* s) {
+    while (s->in == s->inend) {
+        const unsigned char* idat = kit__png_find(s->png, "IDAT", 0);
+        if (!idat) { return 0; }
+        s->in = idat;
+        s->inend = idat + kit__png_get32(idat - 8);
+    }
+    return 1;
+}
+
+// Tops the bit buffer up to at least 56 bits, a whole word at a time while
+// 8 bytes remain in the chunk. Past the last chunk it shifts in zero bytes,
+// but a stream that would consume more than fits in the buffer is truncated.
+static inline void kit__png_refill(kit__PngState* s) {
+    if (s->inend - s->in >= 8) {
+        s->bits |= kit__png_load64(s->in) << s->count;
+        s->in += (63 - s->count) >> 3;
+        s->count |= 56;
+        return;
+    }
+    while (s->count <= 56) {
+        if (kit__png_next_input(s)) {
+            s->bits |= (uint64_t) *s->in++ << s->count;
+        } else {
+            CHECK(++s->pad <= 8);
+        }
+        s->count += 8;
+    }
+}
+
+// Takes bits the caller has already refilled for.
+static inline int kit__png_take(kit__PngState* s, int n) {
+    int v = s->bits & ((1u << n) - 1);
+    s->bits >>= n;
+    s->count -= n;
+    return v;
+}
+
+static int kit__png_bits(kit__PngState* s, int n) {
+    if (s->count < n) { kit__png_refill(s); }
+    return kit__png_take(s, n);
+}
+
+// Entries are (sym << 8) | len for a code of `len` bits, and subtable links
+// are (offset << 8) | 0x10 | bits. Zero marks a code that isn't in use.
+static void kit__png_build(kit__PngState* s, uint32_t* table, int size, int root, const unsigned char* lens, int symcount) {
+    int n, len, max = 0, left = 1, count[16] = { 0 }, offs[16];
+    unsigned short sorted[288];
+
+    // Frequency count; over-subscribed sets are invalid.
+    for (n = 0; n < symcount; n++)
+        count[lens[n]]++;
+    for (len = 1; len <= 15; len++) {
+        left = (left << 1) - count[len];
+        CHECK(left >= 0);
+        if (count[len]) { max = len; }
+    }
+
+    // Sort symbols by code length, then by value.
+    offs[1] = 0;
+    for (len = 1; len < 15; len++)
+        offs[len + 1] = offs[len] + count[len];
+    for (n = 0; n < symcount; n++)
+        if (lens[n]) { sorted[offs[lens[n]]++] = n; }
+
+    // Canonical codes are assigned in that order. Codes share a subtable
+    // when their first `root` bits match, and those are always adjacent.
+    int used = 1 << root, i = 0, prefix = -1, sub = 0, subbits = 0;
+    unsigned code = 0;
+    memset(table, 0, used * sizeof(*table));
+    for (len = 1; len <= max; len++, code <<= 1) {
+        for (; count[len]; count[len]--, code++) {
+            uint32_t entry = (sorted[i++] << 8) | len;
+            unsigned rev = kit__png_rev16(code) >> (16 - len);
+            if (len <= root) {
+                for (unsigned j = rev; j < 1u << root; j += 1 << len) { table[j] = entry; }
+                continue;
+            }
+            if ((int) (rev & ((1 << root) - 1)) != prefix) {
+                // Size the subtable to fit every remaining code with this
+                // prefix.
+                prefix = rev & ((1 << root) - 1);
+                subbits = len - root;
+                int room = 1 << subbits;
+                while (subbits + root < max) {
+                    room -= count[subbits + root];
+                    if (room <= 0) { break; }
+                    subbits++;
+                    room <<= 1;
+                }
+                CHECK(used + (1 << subbits) <= size);
+                sub = used;
+                used += 1 << subbits;
+                memset(table + sub, 0, (1 << subbits) * sizeof(*table));
+                table[prefix] = (sub << 8) | 0x10 | subbits;
+            }
+            for (unsigned j = rev >> root; j < 1u << subbits; j += 1 << (len - root)) {
+                table[sub + j] = entry;
+            }
+        }
+    }
+}
+
+// Decodes one symbol from bits the caller has already refilled for.
+static inline int kit__png_decode(kit__PngState* s, const uint32_t* table, int root) {
+    uint32_t entry = table[s->bits & ((1 << root) - 1)];
+    if (entry & 0x10) {
+        entry = table[(entry >> 8) + ((s->bits >> root) & ((1 << (entry & 0xf)) - 1))];
+    }
+    CHECK(entry);
+    s->bits >>= entry & 0xf;
+    s->count -= entry & 0xf;
+    return entry >> 8;
+}
+
+// A whole refill covers a length/distance pair with both extras (48 bits).
+static void kit__png_run(kit__PngState* s, int sym) {
+    CHECK(sym < 29);
+    int length = kit__png_take(s, kit__png_len_bits[sym]) + kit__png_len_base[sym];
+    int dsym = kit__png_decode(s, s->distcodes, KIT__INFLATE_DIST_BITS);
+    CHECK(dsym < 30);
+    int offs = kit__png_take(s, kit__png_dist_bits[dsym]) + kit__png_dist_base[dsym];
+
+    unsigned char *dest = s->out, *src = dest - offs;
+    CHECK(offs <= dest - s->outstart && length <= s->outend - dest);
+    s->out += length;
+    if (offs >= 8 && length + 8 <= s->outend - dest) {
+        // Word copies may run up to 7 bytes past the end, which are then
+        // overwritten by later output.
+        do {
+            memcpy(dest, src, 8);
+            dest += 8;
+            src += 8;
+            length -= 8;
+        } while (length > 0);
+    } else if (offs == 1) {
+        memset(dest, *src, length);
+    } else {
+        while (length--) { *dest++ = *src++; }
+    }
+}
+
+// Returns 1 at the end of the block, or 0 when the output is nearly full.
+static int kit__png_block(kit__PngState* s) {
+    while (s->outend - s->out >= KIT__INFLATE_SLACK) {
+        kit__png_refill(s);
+        int sym = kit__png_decode(s, s->litcodes, KIT__INFLATE_LIT_BITS);
+        if (sym < 256) {
+            *s->out++ = (unsigned char)sym;
+        } else if (sym > 256) {
+            kit__png_run(s, sym - 257);
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void kit__png_stored_header(kit__PngState* s) {
+    kit__png_bits(s, s->count & 7);
+    s->stored = kit__png_bits(s, 16);
+    CHECK((s->stored ^ kit__png_bits(s, 16)) == 0xffff);
+}
+
+static void kit__png_stored(kit__PngState* s) {
+    // Uncompressed data kit__png_block. Whole bytes still in the bit buffer
+    // come first, the last `pad` of them being past the end of the input.
+    while (s->stored && s->count && s->out < s->outend) {
+        CHECK(s->count / 8 > s->pad);
+        *s->out++ = (unsigned char)kit__png_take(s, 8);
+        s->stored--;
+    }
+    // The buffer may still hold bytes that refills load ahead of `count`.
+    if (s->stored) { s->bits = 0; }
+    while (s->stored && s->out < s->outend) {
+        CHECK(kit__png_next_input(s));
+        int len = s->stored;
+        if (len > s->inend - s->in)   { len = s->inend - s->in; }
+        if (len > s->outend - s->out) { len = s->outend - s->out; }
+        memcpy(s->out, s->in, len);
+        s->out += len;
+        s->in += len;
+        s->stored -= len;
+    }
+}
+
+static void kit__png_fixed(kit__PngState* s) {
+    // Fixed set of Huffman codes, kept while consecutive blocks use them.
+    int n;
+    unsigned char lens[288 + 32];
+    if (s->fixed) { return; }
+    for (n = 0;   n <= 143; n++) { lens[n] = 8; }
+    for (n = 144; n <= 255; n++) { lens[n] = 9; }
+    for (n = 256; n <= 279; n++) { lens[n] = 7; }
+    for (n = 280; n <= 287; n++) { lens[n] = 8; }
+    for (n = 0;   n < 32;   n++) { lens[288 + n] = 5; }
+
+    // Build lit/dist tables.
+    kit__png_build(s, s->litcodes,  KIT__INFLATE_LIT_SIZE,  KIT__INFLATE_LIT_BITS,  lens, 288);
+    kit__png_build(s, s->distcodes, KIT__INFLATE_DIST_SIZE, KIT__INFLATE_DIST_BITS, lens + 288, 32);
+    s->fixed = 1;
+}
+
+static void kit__png_dynamic(kit__PngState* s) {
+    int n, i, nlit, ndist, nlen;
+    unsigned char lenlens[19] = { 0 }, lens[288 + 32];
+    nlit = 257 + kit__png_bits(s, 5);
+    ndist = 1 + kit__png_bits(s, 5);
+    nlen = 4 + kit__png_bits(s, 4);
+    for (n = 0; n < nlen; n++)
+        lenlens[(uint8_t) kit__png_order[n]] = (unsigned char)kit__png_bits(s, 3);
+
+    // Build the table for decoding code lengths.
+    kit__png_build(s, s->lencodes, 1 << KIT__INFLATE_LEN_BITS, KIT__INFLATE_LEN_BITS, lenlens, 19);
+
+    // Decode code lengths.
+    for (n = 0; n < nlit + ndist;) {
+        kit__png_refill(s);
+        int sym = kit__png_decode(s, s->lencodes, KIT__INFLATE_LEN_BITS);
+        CHECK(sym != 16 || n > 0);
+        switch (sym) {
+        case 16: i = 3  + kit__png_take(s, 2); CHECK(n + i <= nlit + ndist); for (; i; i--, n++) { lens[n] = lens[n - 1]; } break;
+        case 17: i = 3  + kit__png_take(s, 3); CHECK(n + i <= nlit + ndist); for (; i; i--, n++) { lens[n] = 0; }           break;
+        case 18: i = 11 + kit__png_take(s, 7); CHECK(n + i <= nlit + ndist); for (; i; i--, n++) { lens[n] = 0; }          break;
+        default: lens[n++] = (unsigned char)sym;                                  break;
+        }
+    }
+
+    // Build lit/dist tables.
+    kit__png_build(s, s->litcodes,  KIT__INFLATE_LIT_SIZE,  KIT__INFLATE_LIT_BITS,  lens, nlit);
+    kit__png_build(s, s->distcodes, KIT__INFLATE_DIST_SIZE, KIT__INFLATE_DIST_BITS, lens + nlit, ndist);
+    s->fixed = 0;
+}
+
+// Inflates until the output is nearly full or the stream ends; the caller
+// makes room and calls again. Returns 0 for malformed data.
+static int kit__png_inflate(kit__PngState* s) {
+    if (setjmp(s->jmp) == 1) { return 0; }
+
+    while (!s->done && s->outend - s->out >= KIT__INFLATE_SLACK) {
+        switch (s->mode) {
+        case KIT__INFLATE_ZLIB: {
+            // Deflate, no preset dictionary, window no larger than ours.
+            int cmf = kit__png_bits(s, 8), flg = kit__png_bits(s, 8);
+            CHECK((cmf & 0x0f) == 0x08 && (cmf & 0xf0) <= 0x70 && (flg & 0x20) == 0);
+            s->mode = KIT__INFLATE_HEADER;
+            break;
+        }
+        case KIT__INFLATE_HEADER:
+            s->last = kit__png_bits(s, 1);
+            switch (kit__png_bits(s, 2)) {
+            case 0: kit__png_stored_header(s); s->mode = KIT__INFLATE_STORED;  break;
+            case 1: kit__png_fixed(s);         s->mode = KIT__INFLATE_HUFFMAN; break;
+            case 2: kit__png_dynamic(s);       s->mode = KIT__INFLATE_HUFFMAN; break;
+            case 3: FAIL();
+            }
+            break;
+        case KIT__INFLATE_HUFFMAN:
+            if (kit__png_block(s)) {
+                s->mode = KIT__INFLATE_HEADER;
+                s->done = s->last;
+            }
+            break;
+        case KIT__INFLATE_STORED:
+            kit__png_stored(s);
+            if (!s->stored) {
+                s->mode = KIT__INFLATE_HEADER;
+                s->done = s->last;
+            }
+            break;
+        }
+    }
+
+    return 1;
+}
+
+#undef CHECK
+#undef FAIL
+
+static unsigned kit__png_get32(const unsigned char* v) {
+    return ((unsigned)v[0] << 24) | (v[1] << 16) | (v[2] << 8) | v[3];
+}
+
+static const unsigned char* kit__png_find(kit__Png* png, const char* chunk, unsigned minlen) {
+    const unsigned char* start;
+    while (png->end - png->p >= 12) {
+        unsigned len = kit__png_get32(png->p + 0);
+        if (len > (unsigned)(png->end - png->p) - 12)
+            break;
+        start = png->p;
+        png->p += len + 12;
+        if (memcmp(start + 4, chunk, 4) == 0 && len >= minlen)
+            return start + 8;
+    }
+
+    return NULL;
+}
+
+static unsigned char kit__png_paeth(unsigned char a, unsigned char b, unsigned char c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+
+static int kit__png_row_bytes(int w, int bipp) {
+    int rowBits = w * bipp;
+    return rowBits / 8 + ((rowBits % 8) ? 1 : 0);
+}
+
+
+#if defined(KIT__SSE2) || defined(KIT__AVX2)
+// Sub, Average and Paeth only depend on the pixel to the left, so 3 and 4
+// byte pixels are done a whole pixel per step, as libpng's sse2 filters do.
+// 3 byte pixels still move 4 bytes at a time while that stays inside the
+// row: the extra byte is rewritten by the next pixel, and nothing bounces
+// through a stack temporary to stall store forwarding.
+static inline __m128i kit__png_load_px(const unsigned char* p, int n) {
+    uint32_t v = 0;
+    memcpy(&v, p, n);
+    return _mm_cvtsi32_si128(v);
+}
+
+static inline void kit__png_store_px(unsigned char* p, __m128i v, int n) {
+    uint32_t x = _mm_cvtsi128_si32(v);
+    memcpy(p, &x, n);
+}
+
+static inline __m128i kit__png_select(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline __m128i kit__png_abs16(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static inline void kit__png_unfilter_px(int f, int len, int bpp, const unsigned char* raw, unsigned char* out, const unsigned char* prev) {
+    __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+    __m128i a = zero, b, c = zero, d;
+    int x;
+#define LOOP(BODY)                                          \
+    for (x = 0; x + 4 <= len; x += bpp) { enum { n = 4 }; BODY } \
+    for (; x < len; x += bpp) { enum { n = 3 }; BODY }      \
+    break
+    switch (f) {
+    case 1: LOOP(
+        a = _mm_add_epi8(kit__png_load_px(raw + x, n), a);
+        kit__png_store_px(out + x, a, n);
+    );
+    case 3: LOOP(
+        // pavgb rounds up, so take the carry back off where a + b is odd
+        b = kit__png_load_px(prev + x, n);
+        d = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(kit__png_load_px(raw + x, n), d);
+        kit__png_store_px(out + x, a, n);
+    );
+    case 4: LOOP(
+        // branchless paeth in 16-bit lanes: pa = |b - c|, pb = |a - c|,
+        // pc = |a + b - 2c|, ties going to a, then b
+        b = _mm_unpacklo_epi8(kit__png_load_px(prev + x, n), zero);
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = kit__png_abs16(_mm_add_epi16(pa, pb));
+        pa = kit__png_abs16(pa);
+        pb = kit__png_abs16(pb);
+        __m128i min = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        d = kit__png_select(_mm_cmpeq_epi16(pa, min), a,
+            kit__png_select(_mm_cmpeq_epi16(pb, min), b, c));
+        d = _mm_add_epi8(kit__png_load_px(raw + x, n), _mm_packus_epi16(d, d));
+        kit__png_store_px(out + x, d, n);
+        a = _mm_unpacklo_epi8(d, zero);
+        c = b;
+    );
+    }
+#undef LOOP
+}
+#endif
+
+// Unfilters one row (its filter type byte first) into `out`, given the
+// previous unfiltered row.
+static int kit__png_unfilter(int len, int bpp, const unsigned char* raw, unsigned char* out, const unsigned char* prev) {
+    int x = 0;
+    int f = *raw++;
+#if defined(KIT__SSE2) || defined(KIT__AVX2)
+    if (f == 2) {
+        for (; x + 16 <= len; x += 16) {
+            __m128i r = _mm_loadu_si128((__m128i*) (raw + x));
+            __m128i b = _mm_loadu_si128((__m128i*) (prev + x));
+            _mm_storeu_si128((__m128i*) (out + x), _mm_add_epi8(r, b));
+        }
+    } else if (f != 0 && f <= 4 && (bpp == 3 || bpp == 4)) {
+        // constant pixel sizes let the per-pixel memcpys become plain moves
+        if (bpp == 4) {
+            kit__png_unfilter_px(f, len, 4, raw, out, prev);
+        } else {
+            kit__png_unfilter_px(f, len, 3, raw, out, prev);
+        }
+        return 1;
+    }
+#endif
+#define LOOP(A, B)            \
+    for (; x < bpp; x++)      \
+        out[x] = raw[x] + A;  \
+    for (; x < len; x++)      \
+        out[x] = raw[x] + B;  \
+    break
+    switch (f) {
+    case 0: memcpy(out, raw, len); break;
+    case 1: LOOP(0, out[x - bpp]);
+    case 2: LOOP(prev[x], prev[x]);
+    case 3: LOOP(prev[x] / 2, (out[x - bpp] + prev[x]) / 2);
+    case 4: LOOP(prev[x], kit__png_paeth(out[x - bpp], prev[x], prev[x - bpp]));
+    default: return 0;
+    }
+#undef LOOP
+    return 1;
+}
+
+// Converts one row to kit_Color, which is bgra in memory. `trns` is the
+// colour key of grey and rgb images, already checked to be long enough.
+static void kit__png_convert(int bypp, int w, const unsigned char* src, kit_Color* dest, const unsigned char* trns) {
+    int x = 0;
+#if defined(KIT__SSE2) || defined(KIT__AVX2)
+    __m128i alpha = _mm_set1_epi32(0xff000000), rgb = _mm_set1_epi32(0x00ffffff);
+    __m128i key = _mm_set1_epi32(-1);
+    if (trns && bypp == 1) { key = _mm_set1_epi32(trns[1] * 0x010101); }
+    if (trns && bypp == 3) { key = _mm_set1_epi32(trns[5] | (trns[3] << 8) | (trns[1] << 16)); }
+    switch (bypp) {
+    case 1:
+        for (; x + 16 <= w; x += 16) {
+            __m128i g = _mm_loadu_si128((__m128i*) (src + x));
+            __m128i gg[2] = { _mm_unpacklo_epi8(g, g), _mm_unpackhi_epi8(g, g) };
+            for (int i = 0; i < 4; i++) {
+                __m128i p = i & 1 ? _mm_unpackhi_epi16(gg[i / 2], gg[i / 2]) : _mm_unpacklo_epi16(gg[i / 2], gg[i / 2]);
+                p = _mm_and_si128(p, rgb);
+                p = _mm_or_si128(p, _mm_andnot_si128(_mm_cmpeq_epi32(p, key), alpha));
+                _mm_storeu_si128((__m128i*) (dest + x + i * 4), p);
+            }
+        }
+        break;
+    case 2:
+        for (; x + 8 <= w; x += 8) {
+            __m128i ga = _mm_loadu_si128((__m128i*) (src + x * 2));
+            __m128i g = _mm_and_si128(ga, _mm_set1_epi16(0xff));
+            __m128i gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+            _mm_storeu_si128((__m128i*) (dest + x),     _mm_unpacklo_epi16(gg, ga));
+            _mm_storeu_si128((__m128i*) (dest + x + 4), _mm_unpackhi_epi16(gg, ga));
+        }
+        break;
+#ifdef KIT__SSSE3
+    case 3: {
+        __m128i swizzle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+        // 16 byte loads cover 4 pixels and must stay inside the row
+        for (; x + 6 <= w; x += 4) {
+            __m128i p = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*) (src + x * 3)), swizzle);
+            p = _mm_or_si128(p, _mm_andnot_si128(_mm_cmpeq_epi32(p, key), alpha));
+            _mm_storeu_si128((__m128i*) (dest + x), p);
+        }
+        break;
+    }
+#endif
+    case 4:
+        for (; x + 4 <= w; x += 4) {
+            // swap r and b: the 16-bit halves of the 0x00rr00bb part
+            __m128i p = _mm_loadu_si128((__m128i*) (src + x * 4));
+            __m128i rb = _mm_and_si128(p, _mm_set1_epi32(0x00ff00ff));
+            rb = _mm_shufflehi_epi16(_mm_shufflelo_epi16(rb, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+            p = _mm_or_si128(_mm_andnot_si128(_mm_set1_epi32(0x00ff00ff), p), rb);
+            _mm_storeu_si128((__m128i*) (dest + x), p);
+        }
+        break;
+    }
+#endif
+    for (src += x * bypp; x < w; x++, src += bypp) {
+        switch (bypp) {
+        case 1: {
+            unsigned char c = src[0];
+            if (trns && c == trns[1]) {
+                dest[x] = kit_rgba(c, c, c, 0);
+            } else {
+                dest[x] = kit_rgb(c, c, c);
+            }
+            break;
+        }
+        case 2:
+            dest[x] = kit_rgba(src[0], src[0], src[0], src[1]);
+            break;
+        case 3: {
+            unsigned char r = src[0];
+            unsigned char g = src[1];
+            unsigned char b = src[2];
+            if (trns && trns[1] == r && trns[3] == g && trns[5] == b) {
+                dest[x] = kit_rgba(r, g, b, 0);
+            } else {
+                dest[x] = kit_rgb(r, g, b);
+            }
+            break;
+        }
+        case 4:
+            dest[x] = kit_rgba(src[0], src[1], src[2], src[3]);
+            break;
+        }
+    }
+}
+
+static void kit__png_depalette(int w, const unsigned char* src, kit_Color* dest, int bipp, const unsigned char* plte, int plteSize, const unsigned char* trns, int trnsSize) {
+    int x, c;
+    unsigned char alpha;
+    int mask = 0;
+    int len = 0;
+
+    switch (bipp) {
+    case 4: mask = 15; len = 1; break;
+    case 2: mask = 3;  len = 3; break;
+    case 1: mask = 1;  len = 7; break;
+    }
+
+    for (x = 0; x < w; x++) {
+        if (bipp == 8) {
+            c = *src++;
+        } else {
+            int pos = x & len;
+            c = (src[0] >> ((len - pos) * bipp)) & mask;
+            if (pos == len) {
+                src++;
+            }
+        }
+        alpha = 255;
+        if (c < trnsSize) {
+            alpha = trns[c];
+        }
+        if (c * 3 >= plteSize) {
+            *dest++ = kit_rgba(0, 0, 0, alpha);
+            continue;
+        }
+        *dest++ = kit_rgba(plte[c * 3 + 0], plte[c * 3 + 1], plte[c * 3 + 2], alpha);
+    }
+}
+
+#define FAIL() goto err;
+#define CHECK(X) if (!(X)) FAIL()
+
+static kit_Image* kit__load_png(void *png_data, int png_len) {
+    kit__Png png = { png_data, ((uint8_t*) png_data) + png_len };
+
+    const unsigned char *ihdr, *plte, *trns, *first;
+    int plteSize = 0, trnsSize = 0;
+    int w, h, depth, ctype, bipp, bpp, rowlen, cap, y;
+    unsigned char *buf = NULL, *rows = NULL, *cur, *prev, *row;
+    kit__PngState* s = NULL;
+    kit_Image* bmp = NULL;
+
+    CHECK(png_len >= 8 && memcmp(png.p, "\211PNG\r\n\032\n", 8) == 0);  // kit__Png signature
+    png.p += 8;
+    first = png.p;
+
+    // Read IHDR
+    ihdr = kit__png_find(&png, "IHDR", 13);
+    CHECK(ihdr);
+    w = kit__png_get32(ihdr + 0);
+    h = kit__png_get32(ihdr + 4);
+    depth = ihdr[8];
+    ctype = ihdr[9];
+    switch (ctype) {
+    case 0: bipp = depth;     break;  // greyscale
+    case 2: bipp = depth * 3; break;  // RGB
+    case 3: bipp = depth;     break;  // paletted
+    case 4: bipp = depth * 2; break;  // grey+alpha
+    case 6: bipp = depth * 4; break;  // RGBA
+    default: FAIL();
+    }
+
+    // We support 8-bit color components and 1, 2, 4 and 8 bit palette formats.
+    // No interlacing, or wacky filter types.
+    CHECK((depth != 16) && ihdr[10] == 0 && ihdr[11] == 0 && ihdr[12] == 0);
+    CHECK(ctype == 3 || bipp % 8 == 0);
+    CHECK(w > 0 && h > 0 && w <= (1 << 24) && w <= (1 << 28) / h);
+
+    // Find palette.
+    png.p = first;
+    plte = kit__png_find(&png, "PLTE", 0);
+    if (plte) { plteSize = kit__png_get32(plte - 8); }
+    CHECK(ctype != 3 || plte);
+
+    // Find transparency info.
+    png.p = first;
+    trns = kit__png_find(&png, "tRNS", 0);
+    if (trns) { trnsSize = kit__png_get32(trns - 8); }
+    if ((ctype == 0 && trnsSize < 2) || (ctype == 2 && trnsSize < 6) || ctype == 4 || ctype == 6) { trns = NULL; }
+
+    // Rows are inflated into a buffer holding the 32k window back-references
+    // need, copied out as they complete, unfiltered against the previous row
+    // and converted straight into the image. Small images fit whole.
+    bmp = kit_create_image(w, h);
+    rowlen = kit__png_row_bytes(w, bipp) + 1;
+    bpp = kit__png_row_bytes(1, bipp);
+    cap = KIT__INFLATE_WINDOW + rowlen + KIT__INFLATE_CHUNK;
+    if ((int64_t) rowlen * h + KIT__INFLATE_SLACK < cap) { cap = rowlen * h + KIT__INFLATE_SLACK; }
+    buf = malloc(cap);
+    rows = kit__alloc(rowlen * 2);
+    s = kit__alloc(sizeof(kit__PngState));
+    CHECK(buf);
+    cur = rows;
+    prev = rows + rowlen;
+
+    png.p = first;
+    s->png = &png;
+    s->out = s->outstart = row = buf;
+    s->outend = buf + cap;
+
+    for (y = 0; y < h;) {
+        CHECK(kit__png_inflate(s));
+
+        for (; y < h && s->out - row >= rowlen; y++, row += rowlen) {
+            CHECK(kit__png_unfilter(rowlen - 1, bpp, row, cur, prev));
+            if (ctype == 3) {
+                kit__png_depalette(w, cur, bmp->pixels + y * w, bipp, plte, plteSize, trns, trnsSize);
+            } else {
+                kit__png_convert(bipp / 8, w, cur, bmp->pixels + y * w, trns);
+            }
+            kit__premultiply_row(bmp->pixels + y * w, w);
+            unsigned char* t = cur; cur = prev; prev = t;
+        }
+        if (y == h) { break; }
+        CHECK(!s->done);
+
+        // Slide down, keeping the window and the partial row.
+        unsigned char* keep = s->out - KIT__INFLATE_WINDOW;
+        if (keep > row) { keep = row; }
+        if (keep > buf) {
+            memmove(buf, keep, s->out - keep);
+            row -= keep - buf;
+            s->out -= keep - buf;
+        }
+    }
+
+    free(s);
+    free(rows);
+    free(buf);
+    return bmp;
+
+err:
+    if (s)    { free(s);    }
+    if (rows) { free(rows); }
+    if (buf)  { free(buf);  }
+    if (bmp)  { kit_destroy_image(bmp); }
+    return NULL;
+}
+
+#undef CHECK
+#undef FAIL
+
+//////////////////////////////////////////////////////////////////////////////
+// PNG writer
+//////////////////////////////////////////////////////////////////////////////
+
+// rows are filtered one at a time and streamed through an lz77 matcher with
+// a 32k window. tokens are buffered per block so each block can be emitted
+// as whichever of stored, fixed or dynamic huffman is smallest. compressed
+// bytes collect in a 64k IDAT chunk that is written out whenever it fills
+
+#define KIT__DEFLATE_WINDOW  32768
+#define KIT__DEFLATE_BLOCK   32768
+#define KIT__DEFLATE_MATCH   258
+#define KIT__DEFLATE_HASH    15
+#define KIT__DEFLATE_IN      (2 * KIT__DEFLATE_WINDOW + KIT__DEFLATE_BLOCK)
+#define KIT__IDAT_SIZE       65536
+
+typedef struct {
+    int mode;
+    // output: a file, or a growing memory buffer
+    FILE *fp;
+    uint8_t *mem;
+    int mem_len, mem_cap;
+    bool failed;
+    // pending IDAT payload and the deflate bit buffer feeding it
+    uint8_t idat[KIT__IDAT_SIZE];
+    int idat_len;
+    uint64_t bits;
+    int nbits;
+    // lz77 input; `in[0]` is stream offset `base`, the hash tables hold
+    // stream offsets so sliding the input doesn't invalidate them
+    uint8_t in[KIT__DEFLATE_IN];
+    int in_len, pos, base;
+    int bpp; // fast mode tries a repeat of the previous pixel first
+    uint32_t adler;
+    int head[1 << KIT__DEFLATE_HASH];
+    int prev[KIT__DEFLATE_WINDOW];
+    // current block: tokens are a literal, or 0x80000000 | len << 16 | dist.
+    // the final block can run on into the lookahead
+    uint32_t tokens[KIT__DEFLATE_BLOCK + KIT__DEFLATE_MATCH];
+    int ntokens;
+    uint32_t lit_freq[286], dist_freq[30];
+    // lookup tables, filled by kit__png_tables() for each encoder so saves
+    // on different threads share nothing
+    uint32_t crc_table[4][256];
+    uint8_t len_sym[KIT__DEFLATE_MATCH + 1];
+    uint8_t dist_lo[256], dist_hi[256];
+    uint8_t fixed_lit_lens[288], fixed_dist_lens[30];
+    uint16_t fixed_lit_codes[288], fixed_dist_codes[30];
+} kit__PngEncoder;
+
+static void kit__huff_codes(const uint8_t *lens, int n, uint16_t *codes);
+
+static void kit__png_tables(kit__PngEncoder *e) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) { c = (c >> 1) ^ (0xedb88320 & -(c & 1)); }
+        e->crc_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 4; k++) {
+            uint32_t c = e->crc_table[k - 1][i];
+            e->crc_table[k][i] = e->crc_table[0][c & 0xff] ^ (c >> 8);
+        }
+    }
+    for (int i = 0; i < 29; i++) {
+        for (int k = 0; k < (1 << kit__png_len_bits[i]); k++) {
+            int len = kit__png_len_base[i] + k;
+            if (len <= KIT__DEFLATE_MATCH) { e->len_sym[len] = i; }
+        }
+    }
+    e->len_sym[KIT__DEFLATE_MATCH] = 28;
+    // distances past 256 start on multiples of 128, so d >> 7 picks the code
+    for (int d = 0, i = 0; d < 256; d++) {
+        while (i < 29 && kit__png_dist_base[i + 1] <= d + 1) { i++; }
+        e->dist_lo[d] = i;
+    }
+    for (int d = 256, i = 0; d < 32768; d += 128) {
+        while (i < 29 && kit__png_dist_base[i + 1] <= d + 1) { i++; }
+        e->dist_hi[d >> 7] = i;
+    }
+    for (int i = 0; i < 288; i++) {
+        e->fixed_lit_lens[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    memset(e->fixed_dist_lens, 5, sizeof(e->fixed_dist_lens));
+    kit__huff_codes(e->fixed_lit_lens, 288, e->fixed_lit_codes);
+    kit__huff_codes(e->fixed_dist_lens, 30, e->fixed_dist_codes);
+}
+
+
+// slicing-by-4: one table lookup per byte, but four bytes per step
+static uint32_t kit__crc32(uint32_t (*t)[256], uint32_t crc, const uint8_t *p, int n) {
+    crc = ~crc;
+    for (; n >= 4; n -= 4, p += 4) {
+        crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+        crc = t[3][crc & 0xff] ^ t[2][(crc >> 8) & 0xff] ^ t[1][(crc >> 16) & 0xff] ^ t[0][crc >> 24];
+    }
+    while (n--) { crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8); }
+    return ~crc;
+}
 
-    int blend_fn = 1;
-    if (mul_color.w != 0xffffffff) { blend_fn = 2; }
-    if ((add_color.w & 0xffffff00) != 0xffffff00) { blend_fn = 3; }
 
-    for (; dy < ey; dy++) {
-        if (dy >= cy1 && dy < cy2) {
-            int sx = src.x << 10;
-            kit_Color *srow = &img->pixels[(sy >> 10) * img->w];
-            kit_Color *drow = &ctx->screen->pixels[dy * ctx->screen->w];
-
-            /* horizontal clipping */
-            int dx = dst.x;
-            if (dx < cx1) { sx += (cx1 - dx) * stepx; dx = cx1; }
-            int ex = kit_min(cx2, dst.x + dst.w);
-
-            for (; dx < ex; dx++) {
-                kit_Color *s = &srow[sx >> 10];
-                kit_Color *d = &drow[dx];
-                switch (blend_fn) {
-                case 1: *d = kit__blend_pixel (*d, *s); break;
-                case 2: *d = kit__blend_pixel2(*d, *s, mul_color); break;
-                case 3: *d = kit__blend_pixel3(*d, *s, mul_color, add_color); break;
-                }
-                sx += stepx;
-            }
+static uint32_t kit__adler32(uint32_t adler, const uint8_t *p, int n) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+#if defined(KIT__SSE2) || defined(KIT__AVX2)
+    // 16 bytes at a time: `sa` sums the bytes, `sp` sums `sa` as it was
+    // before each block and `sw` sums each byte times the number of steps it
+    // is still in `a` for within its block (16 down to 1)
+    __m128i zero = _mm_setzero_si128();
+    __m128i wlo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    __m128i whi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    while (n >= 16) {
+        int k = kit_min(n, 5552) & ~15;
+        n -= k;
+        __m128i sa = zero, sp = zero, sw = zero;
+        for (int i = 0; i < k; i += 16) {
+            __m128i x = _mm_loadu_si128((__m128i*) (p + i));
+            sp = _mm_add_epi32(sp, sa);
+            sa = _mm_add_epi32(sa, _mm_sad_epu8(x, zero));
+            sw = _mm_add_epi32(sw, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), wlo));
+            sw = _mm_add_epi32(sw, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), whi));
         }
-        sy += stepy;
+        p += k;
+        uint32_t ts[4], tp[4], tw[4];
+        _mm_storeu_si128((__m128i*) ts, sa);
+        _mm_storeu_si128((__m128i*) tp, sp);
+        _mm_storeu_si128((__m128i*) tw, sw);
+        uint64_t bb = b + (uint64_t) a * k + (uint64_t) (tp[0] + tp[2]) * 16 + tw[0] + tw[1] + tw[2] + tw[3];
+        a = (a + ts[0] + ts[2]) % 65521;
+        b = bb % 65521;
     }
+#endif
+    while (n > 0) {
+        // 5552 is the most bytes that can be summed before `b` overflows
+        int k = kit_min(n, 5552);
+        n -= k;
+        while (k--) { a += *p++; b += a; }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
 }
 
 
-int kit_draw_text(kit_Context *ctx, kit_Color color, char *text, int x, int y) {
-    return kit_draw_text2(ctx, color, ctx->font, text, x, y);
+static inline void kit__put32be(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
 }
 
 
-int kit_draw_text2(kit_Context *ctx, kit_Color color, kit_Font *font, char *text, int x, int y) {
-    for (uint8_t *p = (void*) text; *p; p++) {
-        kit_Glyph g = font->glyphs[*p];
-        kit_draw_image2(ctx, color, font->image, x, y, g.rect);
-        x += g.xadv;
+static void kit__png_out(kit__PngEncoder *e, const void *data, int n) {
+    if (n == 0) { return; }
+    if (e->fp) {
+        if (fwrite(data, 1, n, e->fp) != n) { e->failed = true; }
+        return;
     }
-    return x;
+    if (e->mem_len + n > e->mem_cap) {
+        e->mem_cap = kit_max(e->mem_cap * 2, e->mem_len + n);
+        e->mem = realloc(e->mem, e->mem_cap);
+        if (!e->mem) { kit__panic("out of memory"); }
+    }
+    memcpy(e->mem + e->mem_len, data, n);
+    e->mem_len += n;
 }
 
 
-//////////////////////////////////////////////////////////////////////////////
-// PNG loader | borrowed from tigr : https://github.com/erkkah/tigr
-//////////////////////////////////////////////////////////////////////////////
-
-typedef struct {
-    const unsigned char *p, *end;
-} kit__Png;
+static void kit__png_chunk(kit__PngEncoder *e, const char *type, const uint8_t *data, int n) {
+    uint8_t buf[8];
+    kit__put32be(buf, n);
+    memcpy(buf + 4, type, 4);
+    kit__png_out(e, buf, 8);
+    kit__png_out(e, data, n);
+    kit__put32be(buf, kit__crc32(e->crc_table, kit__crc32(e->crc_table, 0, (uint8_t*) type, 4), data, n));
+    kit__png_out(e, buf, 4);
+}
 
-typedef struct {
-    unsigned bits, count;
-    const unsigned char *in, *inend;
-    unsigned char *out, *outend;
-    jmp_buf jmp;
-    unsigned litcodes[288], distcodes[32], lencodes[19];
-    int tlit, tdist, tlen;
-} kit__PngState;
 
+static void kit__flush_idat(kit__PngEncoder *e) {
+    if (e->idat_len) { kit__png_chunk(e, "IDAT", e->idat, e->idat_len); }
+    e->idat_len = 0;
+}
 
-#define FAIL() longjmp(s->jmp, 1)
-#define CHECK(X) if (!(X)) { FAIL(); }
 
-// Built-in DEFLATE standard tables.
-static char    kit__png_order[]        = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
-static char  kit__png_len_bits[29 + 2] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0, 0, 0 };
-static int   kit__png_len_base[29 + 2] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0,  0 };
-static char kit__png_dist_bits[30 + 2] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 0, 0 };
-static int  kit__png_dist_base[30 + 2] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static void kit__put_bytes(kit__PngEncoder *e, const uint8_t *p, int n) {
+    while (n > 0) {
+        if (e->idat_len == KIT__IDAT_SIZE) { kit__flush_idat(e); }
+        int k = kit_min(n, KIT__IDAT_SIZE - e->idat_len);
+        memcpy(e->idat + e->idat_len, p, k);
+        e->idat_len += k;
+        p += k;
+        n -= k;
+    }
+}
 
-// Table to bit-reverse a byte.
-static const unsigned char kit__png_reverse_table[256] = {
-#define R2(n) n, n + 128, n + 64, n + 192
-#define R4(n) R2(n), R2(n + 32), R2(n + 16), R2(n + 48)
-#define R6(n) R4(n), R4(n + 8), R4(n + 4), R4(n + 12)
-    R6(0), R6(2), R6(1), R6(3)
-};
-#undef R2
-#undef R4
-#undef R6
 
-static unsigned kit__png_rev16(unsigned n) {
-    return (kit__png_reverse_table[n & 0xff] << 8) | kit__png_reverse_table[(n >> 8) & 0xff];
+// appends 32 bits that have left the bit buffer
+static inline void kit__put_word(kit__PngEncoder *e, uint32_t v) {
+    if (e->idat_len + 4 > KIT__IDAT_SIZE) { kit__flush_idat(e); }
+    uint8_t *p = e->idat + e->idat_len;
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+    e->idat_len += 4;
 }
 
-static int kit__png_bits(kit__PngState* s, int n) {
-    int v = s->bits & ((1 << n) - 1);
-    s->bits >>= n;
-    s->count -= n;
-    while (s->count < 16) {
-        CHECK(s->in != s->inend);
-        s->bits |= (*s->in++) << s->count;
-        s->count += 8;
+
+static inline void kit__put_bits(kit__PngEncoder *e, uint32_t v, int n) {
+    e->bits |= (uint64_t) v << e->nbits;
+    e->nbits += n;
+    if (e->nbits >= 32) {
+        kit__put_word(e, (uint32_t) e->bits);
+        e->bits >>= 32;
+        e->nbits -= 32;
     }
-    return v;
 }
 
-static unsigned char* kit__png_emit(kit__PngState* s, int len) {
-    s->out += len;
-    CHECK(s->out <= s->outend);
-    return s->out - len;
-}
 
-static void kit__png_copy(kit__PngState* s, const unsigned char* src, int len) {
-    unsigned char* dest = kit__png_emit(s, len);
-    while (len--) { *dest++ = *src++; }
+// pads to a byte boundary and moves the bit buffer out
+static void kit__align_bits(kit__PngEncoder *e) {
+    e->nbits = (e->nbits + 7) & ~7;
+    while (e->nbits > 0) {
+        uint8_t b = e->bits;
+        kit__put_bytes(e, &b, 1);
+        e->bits >>= 8;
+        e->nbits -= 8;
+    }
 }
 
-static int kit__png_build(kit__PngState* s, unsigned* tree, unsigned char* lens, int symcount) {
-    int n, codes[16], first[16], counts[16] = { 0 };
 
-    // Frequency count.
-    for (n = 0; n < symcount; n++)
-        counts[lens[n]]++;
+//////////////////////////////////////////////////////////////////////////////
 
-    // Distribute codes.
-    counts[0] = codes[0] = first[0] = 0;
-    for (n = 1; n <= 15; n++) {
-        codes[n] = (codes[n - 1] + counts[n - 1]) << 1;
-        first[n] = first[n - 1] + counts[n - 1];
+// canonical codes, bit reversed since deflate sends them lsb first
+static void kit__huff_codes(const uint8_t *lens, int n, uint16_t *codes) {
+    int count[16] = {0}, next[16];
+    for (int i = 0; i < n; i++) { count[lens[i]]++; }
+    count[0] = 0;
+    for (int b = 1, code = 0; b < 16; b++) {
+        code = (code + count[b - 1]) << 1;
+        next[b] = code;
     }
-    CHECK(first[15] + counts[15] <= symcount);
-
-    // Insert keys into the tree for each symbol.
-    for (n = 0; n < symcount; n++) {
-        int len = lens[n];
-        if (len != 0) {
-            int code = codes[len]++, slot = first[len]++;
-            tree[slot] = (code << (32 - len)) | (n << 4) | len;
-        }
+    for (int i = 0; i < n; i++) {
+        if (lens[i]) { codes[i] = kit__png_rev16(next[lens[i]]++) >> (16 - lens[i]); }
     }
-
-    return first[15];
 }
 
-static int kit__png_decode(kit__PngState* s, unsigned tree[], int max) {
-    // Find the next prefix code.
-    unsigned lo = 0, hi = max, key;
-    unsigned search = (kit__png_rev16(s->bits) << 16) | 0xffff;
-    while (lo < hi) {
-        unsigned guess = (lo + hi) / 2;
-        if (search < tree[guess]) {
-            hi = guess;
-        } else {
-            lo = guess + 1;
-        }
-    }
 
-    // Pull out the key and check it.
-    key = tree[lo - 1];
-    CHECK(((search ^ key) >> (32 - (key & 0xf))) == 0);
+// huffman code lengths limited to `max_bits`. symbols are sorted by
+// frequency and merged with two queues, then an over-long tree has its
+// length counts rebalanced until the kraft sum is exact again
+static void kit__huff_lengths(const uint32_t *freq, int n, int max_bits, uint8_t *lens) {
+    int syms[288], nsyms = 0;
+    memset(lens, 0, n);
+    for (int i = 0; i < n; i++) {
+        if (!freq[i]) { continue; }
+        int j = nsyms++;
+        for (; j > 0 && freq[syms[j - 1]] > freq[i]; j--) { syms[j] = syms[j - 1]; }
+        syms[j] = i;
+    }
+    if (nsyms == 0) { return; }
+    if (nsyms == 1) {
+        // a lone code still needs a complete tree for some decoders
+        lens[syms[0]] = 1;
+        lens[syms[0] ? 0 : 1] = 1;
+        return;
+    }
 
-    kit__png_bits(s, key & 0xf);
-    return (key >> 4) & 0xfff;
-}
+    uint32_t weight[576];
+    int parent[576], depth[576];
+    for (int i = 0; i < nsyms; i++) { weight[i] = freq[syms[i]]; }
+    int leaf = 0, node = nsyms, count = nsyms;
+    while (count < 2 * nsyms - 1) {
+        int pick[2];
+        for (int k = 0; k < 2; k++) {
+            if (leaf < nsyms && (node >= count || weight[leaf] <= weight[node])) {
+                pick[k] = leaf++;
+            } else {
+                pick[k] = node++;
+            }
+        }
+        weight[count] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = parent[pick[1]] = count;
+        count++;
+    }
+    depth[count - 1] = 0;
+    int num[33] = {0};
+    for (int i = count - 2; i >= 0; i--) {
+        depth[i] = depth[parent[i]] + 1;
+        if (i < nsyms) { num[kit_min(depth[i], 32)]++; }
+    }
 
-static void kit__png_run(kit__PngState* s, int sym) {
-    int length = kit__png_bits(s, kit__png_len_bits[sym]) + kit__png_len_base[sym];
-    int dsym = kit__png_decode(s, s->distcodes, s->tdist);
-    int offs = kit__png_bits(s, kit__png_dist_bits[dsym]) + kit__png_dist_base[dsym];
-    kit__png_copy(s, s->out - offs, length);
-}
+    for (int i = max_bits + 1; i <= 32; i++) { num[max_bits] += num[i]; }
+    uint32_t total = 0;
+    for (int i = max_bits; i > 0; i--) { total += (uint32_t) num[i] << (max_bits - i); }
+    while (total != (1u << max_bits)) {
+        num[max_bits]--;
+        for (int i = max_bits - 1; i > 0; i--) {
+            if (num[i]) { num[i]--; num[i + 1] += 2; break; }
+        }
+        total--;
+    }
 
-static void kit__png_block(kit__PngState* s) {
-    for (;;) {
-        int sym = kit__png_decode(s, s->litcodes, s->tlit);
-        if (sym < 256) { *kit__png_emit(s, 1) = (unsigned char)sym; } else
-        if (sym > 256) { kit__png_run(s, sym - 257); } else { break; }
+    // least frequent symbols get the longest codes
+    for (int len = max_bits, j = 0; len > 0; len--) {
+        for (int k = 0; k < num[len]; k++) { lens[syms[j++]] = len; }
     }
 }
 
-static void kit__png_stored(kit__PngState* s) {
-    // Uncompressed data kit__png_block.
-    int len;
-    kit__png_bits(s, s->count & 7);
-    len = kit__png_bits(s, 16);
-    CHECK(((len ^ s->bits) & 0xffff) == 0xffff);
-    CHECK(s->in + len <= s->inend);
 
-    kit__png_copy(s, s->in, len);
-    s->in += len;
-    kit__png_bits(s, 16);
+// the bit buffer is kept in locals here, since the idat stores could alias
+// e->bits and would otherwise force it through memory for every code
+static void kit__put_tokens(kit__PngEncoder *e, const uint8_t *lit_lens, const uint16_t *lit_codes, const uint8_t *dist_lens, const uint16_t *dist_codes) {
+    uint64_t bits = e->bits;
+    int nbits = e->nbits;
+    const uint32_t *tokens = e->tokens;
+    for (int i = 0, n = e->ntokens; i < n; i++) {
+        uint32_t t = tokens[i];
+        if (!(t & 0x80000000)) {
+            bits |= (uint64_t) lit_codes[t] << nbits;
+            nbits += lit_lens[t];
+        } else {
+            // up to 15 + 5 bits for the length and 15 + 13 for the distance,
+            // so one flush between them keeps the buffer under 64 bits
+            int len = (t >> 16) & 0x1ff, dist = t & 0xffff;
+            int ls = e->len_sym[len];
+            bits |= (uint64_t) lit_codes[257 + ls] << nbits;
+            nbits += lit_lens[257 + ls];
+            bits |= (uint64_t) (len - kit__png_len_base[ls]) << nbits;
+            nbits += kit__png_len_bits[ls];
+            if (nbits >= 32) {
+                kit__put_word(e, (uint32_t) bits);
+                bits >>= 32;
+                nbits -= 32;
+            }
+            int d = dist - 1;
+            int ds = d < 256 ? e->dist_lo[d] : e->dist_hi[d >> 7];
+            bits |= (uint64_t) dist_codes[ds] << nbits;
+            nbits += dist_lens[ds];
+            bits |= (uint64_t) (dist - kit__png_dist_base[ds]) << nbits;
+            nbits += kit__png_dist_bits[ds];
+        }
+        if (nbits >= 32) {
+            kit__put_word(e, (uint32_t) bits);
+            bits >>= 32;
+            nbits -= 32;
+        }
+    }
+    e->bits = bits;
+    e->nbits = nbits;
+    kit__put_bits(e, lit_codes[256], lit_lens[256]);
 }
 
-static void kit__png_fixed(kit__PngState* s) {
-    // Fixed set of Huffman codes.
-    int n;
-    unsigned char lens[288 + 32];
-    for (n = 0;   n <= 143; n++) { lens[n] = 8; }
-    for (n = 144; n <= 255; n++) { lens[n] = 9; }
-    for (n = 256; n <= 279; n++) { lens[n] = 7; }
-    for (n = 280; n <= 287; n++) { lens[n] = 8; }
-    for (n = 0;   n < 32;   n++) { lens[288 + n] = 5; }
 
-    // Build lit/dist trees.
-    s->tlit  = kit__png_build(s, s->litcodes,  lens, 288);
-    s->tdist = kit__png_build(s, s->distcodes, lens + 288, 32);
+static void kit__deflate_stored(kit__PngEncoder *e, int start, int end, bool final) {
+    int n = end - start;
+    kit__put_bits(e, final, 3);
+    kit__align_bits(e);
+    uint8_t hdr[4] = { n, n >> 8, ~n, ~n >> 8 };
+    kit__put_bytes(e, hdr, 4);
+    kit__put_bytes(e, e->in + start, n);
 }
 
-static void kit__png_dynamic(kit__PngState* s) {
-    int n, i, nlit, ndist, nlen;
-    unsigned char lenlens[19] = { 0 }, lens[288 + 32];
-    nlit = 257 + kit__png_bits(s, 5);
-    ndist = 1 + kit__png_bits(s, 5);
-    nlen = 4 + kit__png_bits(s, 4);
-    for (n = 0; n < nlen; n++)
-        lenlens[(uint8_t) kit__png_order[n]] = (unsigned char)kit__png_bits(s, 3);
 
-    // Build the tree for decoding code lengths.
-    s->tlen = kit__png_build(s, s->lencodes, lenlens, 19);
+// emits the buffered tokens covering input bytes [start, end) as one block
+static void kit__deflate_emit(kit__PngEncoder *e, int start, int end, bool final) {
+    e->lit_freq[256]++;
+
+    // bits shared by the fixed and dynamic encodings
+    uint32_t extra = 0, fixed_cost = 3;
+    for (int i = 0; i < 286; i++) { fixed_cost += e->lit_freq[i] * e->fixed_lit_lens[i]; }
+    for (int i = 0; i < 30; i++) { fixed_cost += e->dist_freq[i] * 5; }
+    for (int i = 0; i < 29; i++) { extra += e->lit_freq[257 + i] * kit__png_len_bits[i]; }
+    for (int i = 0; i < 30; i++) { extra += e->dist_freq[i] * kit__png_dist_bits[i]; }
+    fixed_cost += extra;
+    uint32_t stored_cost = 3 + 7 + 32 + (end - start) * 8;
+
+    // dynamic trees, with the code length sequence run-length coded
+    uint8_t lit_lens[286], dist_lens[30], cl_lens[19];
+    uint16_t lit_codes[286], dist_codes[30], cl_codes[19];
+    uint8_t cl_syms[286 + 30], cl_extra[286 + 30];
+    uint32_t cl_freq[19] = {0};
+    int ncl = 0, hlit = 257, hdist = 1, hclen = 4;
+    uint32_t dynamic_cost = 0xffffffff;
+    if (e->mode == KIT_SAVE_SMALL) {
+        kit__huff_lengths(e->lit_freq, 286, 15, lit_lens);
+        kit__huff_lengths(e->dist_freq, 30, 15, dist_lens);
+        for (hlit = 286; hlit > 257 && !lit_lens[hlit - 1]; hlit--) {}
+        for (hdist = 30; hdist > 1 && !dist_lens[hdist - 1]; hdist--) {}
+
+        uint8_t all[286 + 30];
+        memcpy(all, lit_lens, hlit);
+        memcpy(all + hlit, dist_lens, hdist);
+        for (int i = 0, total = hlit + hdist; i < total;) {
+            int len = all[i], run = 1;
+            while (i + run < total && all[i + run] == len) { run++; }
+            i += run;
+            if (len == 0) {
+                for (; run >= 11; run -= kit_min(run, 138)) {
+                    cl_syms[ncl] = 18; cl_extra[ncl++] = kit_min(run, 138) - 11;
+                }
+                if (run >= 3) { cl_syms[ncl] = 17; cl_extra[ncl++] = run - 3; run = 0; }
+            } else {
+                cl_syms[ncl] = len; cl_extra[ncl++] = 0; run--;
+                for (; run >= 3; run -= kit_min(run, 6)) {
+                    cl_syms[ncl] = 16; cl_extra[ncl++] = kit_min(run, 6) - 3;
+                }
+            }
+            while (run-- > 0) { cl_syms[ncl] = len; cl_extra[ncl++] = 0; }
+        }
+        for (int i = 0; i < ncl; i++) { cl_freq[cl_syms[i]]++; }
+        kit__huff_lengths(cl_freq, 19, 7, cl_lens);
+        for (hclen = 19; hclen > 4 && !cl_lens[(int) kit__png_order[hclen - 1]]; hclen--) {}
+
+        dynamic_cost = 3 + 14 + hclen * 3 + extra;
+        dynamic_cost += cl_freq[16] * 2 + cl_freq[17] * 3 + cl_freq[18] * 7;
+        for (int i = 0; i < 19; i++) { dynamic_cost += cl_freq[i] * cl_lens[i]; }
+        for (int i = 0; i < 286; i++) { dynamic_cost += e->lit_freq[i] * lit_lens[i]; }
+        for (int i = 0; i < 30; i++) { dynamic_cost += e->dist_freq[i] * dist_lens[i]; }
+    }
 
-    // Decode code lengths.
-    for (n = 0; n < nlit + ndist;) {
-        int sym = kit__png_decode(s, s->lencodes, s->tlen);
-        switch (sym) {
-        case 16: for (i = 3 + kit__png_bits(s, 2); i; i--, n++) { lens[n] = lens[n - 1]; } break;
-        case 17: for (i = 3 + kit__png_bits(s, 3); i; i--, n++) { lens[n] = 0; }           break;
-        case 18: for (i = 11 + kit__png_bits(s, 7); i; i--, n++) { lens[n] = 0; }          break;
-        default: lens[n++] = (unsigned char)sym;                                  break;
+    if (stored_cost <= fixed_cost && stored_cost <= dynamic_cost) {
+        kit__deflate_stored(e, start, end, final);
+    } else if (fixed_cost <= dynamic_cost) {
+        kit__put_bits(e, final | (1 << 1), 3);
+        kit__put_tokens(e, e->fixed_lit_lens, e->fixed_lit_codes, e->fixed_dist_lens, e->fixed_dist_codes);
+    } else {
+        kit__put_bits(e, final | (2 << 1), 3);
+        kit__put_bits(e, hlit - 257, 5);
+        kit__put_bits(e, hdist - 1, 5);
+        kit__put_bits(e, hclen - 4, 4);
+        for (int i = 0; i < hclen; i++) { kit__put_bits(e, cl_lens[(int) kit__png_order[i]], 3); }
+        kit__huff_codes(cl_lens, 19, cl_codes);
+        for (int i = 0; i < ncl; i++) {
+            int s = cl_syms[i];
+            kit__put_bits(e, cl_codes[s], cl_lens[s]);
+            if (s >= 16) { kit__put_bits(e, cl_extra[i], s == 16 ? 2 : s == 17 ? 3 : 7); }
         }
+        kit__huff_codes(lit_lens, 286, lit_codes);
+        kit__huff_codes(dist_lens, 30, dist_codes);
+        kit__put_tokens(e, lit_lens, lit_codes, dist_lens, dist_codes);
     }
 
-    // Build lit/dist trees.
-    s->tlit  = kit__png_build(s, s->litcodes,  lens, nlit);
-    s->tdist = kit__png_build(s, s->distcodes, lens + nlit, ndist);
+    e->ntokens = 0;
+    memset(e->lit_freq, 0, sizeof(e->lit_freq));
+    memset(e->dist_freq, 0, sizeof(e->dist_freq));
 }
 
-int kit__png_inflate(void* out, unsigned outlen, const void* in, unsigned inlen) {
-    int last;
-    kit__PngState state = {0};
-    kit__PngState *s = &state;
-
-    // We assume we can buffer 2 extra bytes from off the end of 'in'.
-    s->in     = (unsigned char*)in;
-    s->inend  = s->in + inlen + 2;
-    s->out    = (unsigned char*)out;
-    s->outend = s->out + outlen;
-    s->bits   = 0;
-    s->count  = 0;
-    kit__png_bits(s, 0);
 
-    if (setjmp(s->jmp) == 1) { return 0; }
+static inline uint32_t kit__deflate_hash(const uint8_t *p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    return (v * 2654435761u) >> (32 - KIT__DEFLATE_HASH);
+}
 
-    do {
-        last = kit__png_bits(s, 1);
-        switch (kit__png_bits(s, 2)) {
-        case 0: kit__png_stored(s);            break;
-        case 1: kit__png_fixed(s);   kit__png_block(s); break;
-        case 2: kit__png_dynamic(s); kit__png_block(s); break;
-        case 3: FAIL();
-        }
-    } while (!last);
 
-    return 1;
+static inline int kit__match_len(const uint8_t *a, const uint8_t *b, int max) {
+    int n = 0;
+#if (defined(KIT__SSE2) || defined(KIT__AVX2)) && defined(__GNUC__)
+    for (; n + 16 <= max; n += 16) {
+        __m128i x = _mm_loadu_si128((__m128i*) (a + n));
+        __m128i y = _mm_loadu_si128((__m128i*) (b + n));
+        unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffff;
+        if (m) { return n + __builtin_ctz(m); }
+    }
+#endif
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; n + 8 <= max; n += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        if (x != y) { return n + (__builtin_ctzll(x ^ y) >> 3); }
+    }
+#endif
+    while (n < max && a[n] == b[n]) { n++; }
+    return n;
 }
 
-#undef CHECK
-#undef FAIL
 
-static unsigned kit__png_get32(const unsigned char* v) {
-    return (v[0] << 24) | (v[1] << 16) | (v[2] << 8) | v[3];
+static inline void kit__deflate_insert(kit__PngEncoder *e, int p) {
+    if (p + 4 > e->in_len) { return; }
+    uint32_t h = kit__deflate_hash(e->in + p);
+    e->prev[(e->base + p) & (KIT__DEFLATE_WINDOW - 1)] = e->head[h];
+    e->head[h] = e->base + p;
 }
 
-static const unsigned char* kit__png_find(kit__Png* png, const char* chunk, unsigned minlen) {
-    const unsigned char* start;
-    while (png->p < png->end) {
-        unsigned len = kit__png_get32(png->p + 0);
-        start = png->p;
-        png->p += len + 12;
-        if (memcmp(start + 4, chunk, 4) == 0 && len >= minlen && png->p <= png->end)
-            return start + 8;
-    }
 
-    return NULL;
+// longest match for input index `p`, which is then inserted into the hash
+// chains. up to 128 links of the chain are walked
+static int kit__deflate_find(kit__PngEncoder *e, int p, int *dist) {
+    int max = kit_min(KIT__DEFLATE_MATCH, e->in_len - p);
+    if (max < 4) { return 0; }
+    int at = e->base + p, best = 0;
+    uint32_t h = kit__deflate_hash(e->in + p);
+    int cand = e->head[h];
+    e->prev[at & (KIT__DEFLATE_WINDOW - 1)] = cand;
+    e->head[h] = at;
+
+    int chain = 128;
+    const uint8_t *s = e->in + p;
+    while (chain-- && cand < at && cand >= e->base && at - cand <= KIT__DEFLATE_WINDOW) {
+        const uint8_t *c = e->in + (cand - e->base);
+        if (c[best] == s[best]) {
+            int n = kit__match_len(c, s, max);
+            if (n > best) {
+                best = n;
+                *dist = at - cand;
+                if (n == max) { break; }
+            }
+        }
+        // ring slots get reused, so a link that doesn't go back is stale
+        int next = e->prev[cand & (KIT__DEFLATE_WINDOW - 1)];
+        if (next >= cand) { break; }
+        cand = next;
+    }
+    return best >= 4 ? best : 0;
 }
 
-static unsigned char kit__png_paeth(unsigned char a, unsigned char b, unsigned char c) {
-    int p = a + b - c;
-    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
-    return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+
+static inline void kit__deflate_literal(kit__PngEncoder *e, int p) {
+    e->tokens[e->ntokens++] = e->in[p];
+    e->lit_freq[e->in[p]]++;
 }
 
 
-static int kit__png_row_bytes(int w, int bipp) {
-    int rowBits = w * bipp;
-    return rowBits / 8 + ((rowBits % 8) ? 1 : 0);
+static inline void kit__deflate_copy(kit__PngEncoder *e, int len, int dist) {
+    e->tokens[e->ntokens++] = 0x80000000 | (len << 16) | dist;
+    e->lit_freq[257 + e->len_sym[len]]++;
+    int d = dist - 1;
+    e->dist_freq[d < 256 ? e->dist_lo[d] : e->dist_hi[d >> 7]]++;
 }
 
 
-static int kit__png_unfilter(int w, int h, int bipp, unsigned char* raw) {
-    int len = kit__png_row_bytes(w, bipp);
-    int bpp = kit__png_row_bytes(1, bipp);
-    int x, y;
-    unsigned char* first = (unsigned char*)malloc(len + 1);
-    memset(first, 0, len + 1);
-    unsigned char* prev = first;
-    for (y = 0; y < h; y++, prev = raw, raw += len) {
-#define LOOP(A, B)            \
-    for (x = 0; x < bpp; x++) \
-        raw[x] += A;          \
-    for (; x < len; x++)      \
-        raw[x] += B;          \
-    break
-        switch (*raw++) {
-        case 0: break;
-        case 1: LOOP(0, raw[x - bpp]);
-        case 2: LOOP(prev[x], prev[x]);
-        case 3: LOOP(prev[x] / 2, (raw[x - bpp] + prev[x]) / 2);
-        case 4: LOOP(prev[x], kit__png_paeth(raw[x - bpp], prev[x], prev[x - bpp]));
-        default: return 0;
+// fast mode's match finder: a try at repeating the previous pixel, which
+// catches the flat runs filtering leaves, then the newest hash candidate
+static inline int kit__deflate_probe(kit__PngEncoder *e, int p, int *dist) {
+    int max = kit_min(KIT__DEFLATE_MATCH, e->in_len - p), len = 0;
+    if (max < 4) { return 0; }
+    const uint8_t *s = e->in + p;
+    uint32_t h = kit__deflate_hash(s);
+    int at = e->base + p, cand = e->head[h];
+    e->head[h] = at;
+    if (p >= e->bpp) {
+        len = kit__match_len(s - e->bpp, s, max);
+        *dist = e->bpp;
+    }
+    if (len < max && cand < at && cand >= e->base && at - cand <= KIT__DEFLATE_WINDOW && at - cand != e->bpp) {
+        const uint8_t *c = e->in + (cand - e->base);
+        if (c[len] == s[len]) {
+            int n = kit__match_len(c, s, max);
+            if (n > len) { len = n; *dist = at - cand; }
         }
-#undef LOOP
     }
-    free(first);
-    return 1;
+    return len >= 4 ? len : 0;
 }
 
-static void kit__png_convert(int bypp, int w, int h, const unsigned char* src, kit_Color* dest, const unsigned char* trns) {
-    int x, y;
-    for (y = 0; y < h; y++) {
-        src++;  // skip filter byte
-        for (x = 0; x < w; x++, src += bypp) {
-            switch (bypp) {
-            case 1: {
-                unsigned char c = src[0];
-                if (trns && c == *trns) {
-                    *dest++ = kit_rgba(c, c, c, 0);
-                    break;
-                } else {
-                    *dest++ = kit_rgb(c, c, c);
-                    break;
+
+// fast mode writes fixed huffman codes straight from the match finder, with
+// no token buffer. each block is kept whole in the idat buffer so it can be
+// taken back if storing it comes out smaller, and a long stretch without
+// matches ends the block and is stored as it is
+static void kit__deflate_fast(kit__PngEncoder *e, int limit, bool final) {
+    int len = 0, dist = 0;
+    do {
+        // no code is longer than 9 bits a byte, matches included
+        int start = e->pos;
+        if (e->idat_len + ((limit - start) * 9 + 64) / 8 + 8 > KIT__IDAT_SIZE) { kit__flush_idat(e); }
+        int idat_len = e->idat_len, nbits0 = e->nbits;
+        uint64_t bits0 = e->bits;
+        kit__put_bits(e, final | (1 << 1), 3);
+
+        const uint8_t *in = e->in;
+        uint64_t bits = e->bits;
+        int nbits = e->nbits, p = start, q = limit, misses = 0;
+        while (p < limit) {
+            if (!len) { len = kit__deflate_probe(e, p, &dist); }
+            if (!len) {
+                // probes get sparser the longer it goes without a match. once
+                // they are sparse the stretch is found without coding it, and
+                // stored if it's long
+                q = kit_min(p + 1 + (misses++ >> 5), limit);
+                if (misses > 64 && !final) {
+                    while (q < limit && !(len = kit__deflate_probe(e, q, &dist))) {
+                        q = kit_min(q + 1 + (misses++ >> 5), limit);
+                    }
+                    if (q - p >= 64) { break; }
                 }
-            }
-            case 2:
-                *dest++ = kit_rgba(src[0], src[0], src[0], src[1]);
-                break;
-            case 3: {
-                unsigned char r = src[0];
-                unsigned char g = src[1];
-                unsigned char b = src[2];
-                if (trns && trns[1] == r && trns[3] == g && trns[5] == b) {
-                    *dest++ = kit_rgba(r, g, b, 0);
-                    break;
-                } else {
-                    *dest++ = kit_rgb(r, g, b);
-                    break;
+                for (; p < q; p++) {
+                    bits |= (uint64_t) e->fixed_lit_codes[in[p]] << nbits;
+                    nbits += e->fixed_lit_lens[in[p]];
+                    if (nbits >= 32) {
+                        kit__put_word(e, (uint32_t) bits);
+                        bits >>= 32;
+                        nbits -= 32;
+                    }
                 }
+                continue;
             }
-            case 4:
-                *dest++ = kit_rgba(src[0], src[1], src[2], src[3]);
-                break;
+
+            // at most 8 + 5 bits for the length and 5 + 13 for the distance
+            int ls = e->len_sym[len];
+            bits |= (uint64_t) e->fixed_lit_codes[257 + ls] << nbits;
+            nbits += e->fixed_lit_lens[257 + ls];
+            bits |= (uint64_t) (len - kit__png_len_base[ls]) << nbits;
+            nbits += kit__png_len_bits[ls];
+            int d = dist - 1;
+            int ds = d < 256 ? e->dist_lo[d] : e->dist_hi[d >> 7];
+            bits |= (uint64_t) e->fixed_dist_codes[ds] << nbits;
+            nbits += 5;
+            bits |= (uint64_t) (dist - kit__png_dist_base[ds]) << nbits;
+            nbits += kit__png_dist_bits[ds];
+            if (nbits >= 32) {
+                kit__put_word(e, (uint32_t) bits);
+                bits >>= 32;
+                nbits -= 32;
             }
+            p += len;
+            len = misses = 0;
         }
-    }
+        e->bits = bits;
+        e->nbits = nbits;
+        kit__put_bits(e, e->fixed_lit_codes[256], e->fixed_lit_lens[256]);
+
+        int64_t fixed_cost = (int64_t) (e->idat_len - idat_len) * 8 + e->nbits - nbits0;
+        int64_t stored_cost = 3 + 7 + 32 + (int64_t) (p - start) * 8;
+        if (stored_cost <= fixed_cost) {
+            e->idat_len = idat_len;
+            e->bits = bits0;
+            e->nbits = nbits0;
+            kit__deflate_stored(e, start, p, final);
+        }
+        // the stretch that broke off the block, if any
+        if (p < limit) {
+            kit__deflate_stored(e, p, q, false);
+            p = q;
+        }
+        e->pos = p;
+    } while (e->pos < limit);
 }
 
-static void kit__png_depalette(int w, int h, unsigned char* src, kit_Color* dest, int bipp, const unsigned char* plte, const unsigned char* trns, int trnsSize) {
-    int x, y, c;
-    unsigned char alpha;
-    int mask = 0;
-    int len = 0;
 
-    switch (bipp) {
-    case 4: mask = 15; len = 1; break;
-    case 2: mask = 3;  len = 3; break;
-    case 1: mask = 1;  len = 7; break;
+// tokenizes one block from `pos`. matches may run up to 257 bytes past the
+// block, which is why callers keep that much lookahead buffered
+static void kit__deflate_block(kit__PngEncoder *e, bool final) {
+    int start = e->pos;
+    int limit = final ? e->in_len : start + KIT__DEFLATE_BLOCK;
+    if (e->mode == KIT_SAVE_STORE) {
+        e->pos = limit;
+        kit__deflate_stored(e, start, limit, final);
+        return;
+    }
+    if (e->mode == KIT_SAVE_FAST) {
+        kit__deflate_fast(e, limit, final);
+        return;
     }
 
-    for (y = 0; y < h; y++) {
-        src++;  // skip filter byte
-        for (x = 0; x < w; x++) {
-            if (bipp == 8) {
-                c = *src++;
-            } else {
-                int pos = x & len;
-                c = (src[0] >> ((len - pos) * bipp)) & mask;
-                if (pos == len) {
-                    src++;
-                }
-            }
-            alpha = 255;
-            if (c < trnsSize) {
-                alpha = trns[c];
+    int p = start, len = -1, dist = 0;
+    while (p < limit) {
+        if (len < 0) { len = kit__deflate_find(e, p, &dist); }
+        if (!len) {
+            kit__deflate_literal(e, p++);
+            len = -1;
+            continue;
+        }
+        int k = 1;
+        if (p + 1 < limit) {
+            // lazy matching: take a literal if the next byte matches longer
+            int dist2, len2 = kit__deflate_find(e, p + 1, &dist2);
+            if (len2 > len) {
+                kit__deflate_literal(e, p++);
+                len = len2;
+                dist = dist2;
+                continue;
             }
-            *dest++ = kit_rgba(plte[c * 3 + 0], plte[c * 3 + 1], plte[c * 3 + 2], alpha);
+            k = 2;
         }
+        kit__deflate_copy(e, len, dist);
+        for (; k < len; k++) { kit__deflate_insert(e, p + k); }
+        p += len;
+        len = -1;
     }
+    e->pos = p;
+    kit__deflate_emit(e, start, p, final);
 }
 
-#define FAIL() goto err;
-#define CHECK(X) if (!(X)) FAIL()
 
-static int kit__png_outsize(kit_Image* bmp, int bipp) {
-    return (kit__png_row_bytes(bmp->w, bipp) + 1) * bmp->h;
+static void kit__deflate_write(kit__PngEncoder *e, const uint8_t *data, int n) {
+    e->adler = kit__adler32(e->adler, data, n);
+    while (n > 0) {
+        int k = kit_min(n, KIT__DEFLATE_IN - e->in_len);
+        memcpy(e->in + e->in_len, data, k);
+        e->in_len += k;
+        data += k;
+        n -= k;
+        while (e->in_len - e->pos >= KIT__DEFLATE_BLOCK + KIT__DEFLATE_MATCH) {
+            kit__deflate_block(e, false);
+        }
+        // keep a window of history before `pos` and drop the rest
+        int drop = e->pos - KIT__DEFLATE_WINDOW;
+        if (drop > 0) {
+            memmove(e->in, e->in + drop, e->in_len - drop);
+            e->in_len -= drop;
+            e->pos -= drop;
+            e->base += drop;
+        }
+    }
 }
 
-static kit_Image* kit__load_png(void *png_data, int png_len) {
-    kit__Png png = { png_data, ((uint8_t*) png_data) + png_len };
 
-    const unsigned char *ihdr, *idat, *plte, *trns, *first;
-    int trnsSize = 0;
-    int depth, ctype, bipp;
-    int datalen = 0;
-    unsigned char *data = NULL, *out;
-    kit_Image* bmp = NULL;
+static void kit__deflate_finish(kit__PngEncoder *e) {
+    kit__deflate_block(e, true);
+    kit__align_bits(e);
+    uint8_t buf[4];
+    kit__put32be(buf, e->adler);
+    kit__put_bytes(e, buf, 4);
+    kit__flush_idat(e);
+}
 
-    CHECK(memcmp(png.p, "\211PNG\r\n\032\n", 8) == 0);  // kit__Png signature
-    png.p += 8;
-    first = png.p;
 
-    // Read IHDR
-    ihdr = kit__png_find(&png, "IHDR", 13);
-    CHECK(ihdr);
-    depth = ihdr[8];
-    ctype = ihdr[9];
-    switch (ctype) {
-    case 0: bipp = depth;     break;  // greyscale
-    case 2: bipp = depth * 3; break;  // RGB
-    case 3: bipp = depth;     break;  // paletted
-    case 4: bipp = depth * 2; break;  // grey+alpha
-    case 6: bipp = depth * 4; break;  // RGBA
-    default: FAIL();
+//////////////////////////////////////////////////////////////////////////////
+
+// sum of |x| over the row read as signed bytes; |x| is min(x, -x) unsigned
+static uint32_t kit__png_residual(const uint8_t *p, int n) {
+    uint32_t sum = 0;
+    int i = 0;
+#if defined(KIT__SSE2) || defined(KIT__AVX2)
+    __m128i zero = _mm_setzero_si128(), acc = zero;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i*) (p + i));
+        x = _mm_min_epu8(x, _mm_sub_epi8(zero, x));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(x, zero));
     }
+    sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for (; i < n; i++) { sum += abs((int8_t) p[i]); }
+    return sum;
+}
 
-    // Allocate bitmap (+1 width to save room for stupid kit__Png filter bytes)
-    bmp = kit_create_image(kit__png_get32(ihdr + 0) + 1, kit__png_get32(ihdr + 4));
-    CHECK(bmp);
-    bmp->w--;
 
-    // We support 8-bit color components and 1, 2, 4 and 8 bit palette formats.
-    // No interlacing, or wacky filter types.
-    CHECK((depth != 16) && ihdr[10] == 0 && ihdr[11] == 0 && ihdr[12] == 0);
+// kit__png_residual() of the none, sub and up filtered row in one pass,
+// without writing any of them out
+static void kit__png_residuals(const uint8_t *cur, const uint8_t *prev, int bpp, int n, uint32_t sums[3]) {
+    sums[0] = sums[1] = sums[2] = 0;
+    int i = 0;
+    for (; i < bpp; i++) {
+        sums[0] += abs((int8_t) cur[i]);
+        sums[1] += abs((int8_t) cur[i]);
+        sums[2] += abs((int8_t) (cur[i] - prev[i]));
+    }
+#if defined(KIT__SSE2) || defined(KIT__AVX2)
+    __m128i zero = _mm_setzero_si128(), acc0 = zero, acc1 = zero, acc2 = zero;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i*) (cur + i));
+        __m128i s = _mm_sub_epi8(x, _mm_loadu_si128((__m128i*) (cur + i - bpp)));
+        __m128i u = _mm_sub_epi8(x, _mm_loadu_si128((__m128i*) (prev + i)));
+        acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(_mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero));
+        acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(_mm_min_epu8(s, _mm_sub_epi8(zero, s)), zero));
+        acc2 = _mm_add_epi64(acc2, _mm_sad_epu8(_mm_min_epu8(u, _mm_sub_epi8(zero, u)), zero));
+    }
+    sums[0] += _mm_cvtsi128_si32(acc0) + _mm_cvtsi128_si32(_mm_srli_si128(acc0, 8));
+    sums[1] += _mm_cvtsi128_si32(acc1) + _mm_cvtsi128_si32(_mm_srli_si128(acc1, 8));
+    sums[2] += _mm_cvtsi128_si32(acc2) + _mm_cvtsi128_si32(_mm_srli_si128(acc2, 8));
+#endif
+    for (; i < n; i++) {
+        sums[0] += abs((int8_t) cur[i]);
+        sums[1] += abs((int8_t) (cur[i] - cur[i - bpp]));
+        sums[2] += abs((int8_t) (cur[i] - prev[i]));
+    }
+}
 
-    // Join IDAT chunks.
-    for (idat = kit__png_find(&png, "IDAT", 0); idat; idat = kit__png_find(&png, "IDAT", 0)) {
-        unsigned len = kit__png_get32(idat - 8);
-        data = (unsigned char*)realloc(data, datalen + len);
-        if (!data)
-            break;
 
-        memcpy(data + datalen, idat, len);
-        datalen += len;
+static void kit__png_diff(uint8_t *o, const uint8_t *a, const uint8_t *b, int n) {
+    int i = 0;
+#if defined(KIT__SSE2) || defined(KIT__AVX2)
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i*) (a + i));
+        __m128i y = _mm_loadu_si128((__m128i*) (b + i));
+        _mm_storeu_si128((__m128i*) (o + i), _mm_sub_epi8(x, y));
     }
+#endif
+    for (; i < n; i++) { o[i] = a[i] - b[i]; }
+}
 
-    // Find palette.
-    png.p = first;
-    plte = kit__png_find(&png, "PLTE", 0);
 
-    // Find transparency info.
-    png.p = first;
-    trns = kit__png_find(&png, "tRNS", 0);
-    if (trns) { trnsSize = kit__png_get32(trns - 8); }
+// filters a row, returning it with its filter type byte at [-1]. the filter
+// with the smallest sum of absolute signed residuals wins, the usual png
+// heuristic; fast mode only considers none, sub and up, and small mode prefers
+// them when avg or paeth come close. `cur` and `prev` carry a zero type byte
+// already, so they double as the unfiltered row
+static uint8_t* kit__png_filter_row(int mode, int bpp, int n, uint8_t *cur, const uint8_t *prev, uint8_t *out[5]) {
+    uint32_t sums[3], sum;
+    kit__png_residuals(cur, prev, bpp, n, sums);
+    int f = sums[1] < sums[0];
+    if (sums[2] < sums[f]) { f = 2; }
+    uint8_t *o, *best = f ? out[f] : cur;
+    uint32_t best_sum = sums[f];
+    if (f == 1) {
+        for (int i = 0; i < bpp; i++) { best[i] = cur[i]; }
+        kit__png_diff(best + bpp, cur + bpp, cur, n - bpp);
+    } else if (f == 2) {
+        kit__png_diff(best, cur, prev, n);
+    }
 
-    CHECK(data && datalen >= 6);
-    CHECK(
-           (data[0] & 0x0f) == 0x08  // compression method (RFC 1950)
-        && (data[0] & 0xf0) <= 0x70  // window size
-        && (data[1] & 0x20) == 0     // preset dictionary present
-    );
+    if (mode != KIT_SAVE_SMALL) { return best; }
+
+    // avg and paeth leave smaller residuals but break up the runs and repeats
+    // that none/sub/up keep, so they have to win by a clear margin
+    best_sum -= best_sum / 8;
 
-    out = (unsigned char*)bmp->pixels + kit__png_outsize(bmp, 32) - kit__png_outsize(bmp, bipp);
-    CHECK(kit__png_inflate(out, kit__png_outsize(bmp, bipp), data + 2, datalen - 6));
-    CHECK(kit__png_unfilter(bmp->w, bmp->h, bipp, out));
+    o = out[3];
+    for (int i = 0; i < bpp; i++) { o[i] = cur[i] - (prev[i] >> 1); }
+    for (int i = bpp; i < n; i++) { o[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1); }
+    if ((sum = kit__png_residual(o, n)) < best_sum) { best_sum = sum; best = o; }
 
-    if (ctype == 3) {
-        CHECK(plte);
-        kit__png_depalette(bmp->w, bmp->h, out, bmp->pixels, bipp, plte, trns, trnsSize);
+    o = out[4];
+    for (int i = 0; i < bpp; i++) { o[i] = cur[i] - prev[i]; }
+    for (int i = bpp; i < n; i++) { o[i] = cur[i] - kit__png_paeth(cur[i - bpp], prev[i], prev[i - bpp]); }
+    if ((sum = kit__png_residual(o, n)) < best_sum) { best_sum = sum; best = o; }
+
+    return best;
+}
+
+
+// rgb or rgba bytes for one row of pixels, the reverse of kit__png_convert()
+static void kit__png_pack_row(uint8_t *d, const kit_Color *s, int w, int bpp) {
+    int x = 0;
+#if !defined(KIT_PREMULTIPLIED) && (defined(KIT__SSE2) || defined(KIT__AVX2))
+    if (bpp == 4) {
+        for (; x + 4 <= w; x += 4) {
+            __m128i p = _mm_loadu_si128((__m128i*) (s + x));
+            __m128i rb = _mm_and_si128(p, _mm_set1_epi32(0x00ff00ff));
+            rb = _mm_shufflehi_epi16(_mm_shufflelo_epi16(rb, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+            p = _mm_or_si128(_mm_andnot_si128(_mm_set1_epi32(0x00ff00ff), p), rb);
+            _mm_storeu_si128((__m128i*) (d + x * 4), p);
+        }
     } else {
-        CHECK(bipp % 8 == 0);
-        kit__png_convert(bipp / 8, bmp->w, bmp->h, out, bmp->pixels, trns);
+        // 16 byte stores cover 4 pixels and must stay inside the row
+        for (; x + 6 <= w; x += 4) {
+            __m128i p = _mm_loadu_si128((__m128i*) (s + x));
+#ifdef KIT__SSSE3
+            p = _mm_shuffle_epi8(p, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+#else
+            // swap r and b, squeeze the alpha out of each pair of pixels,
+            // then close the gap between the two pairs
+            __m128i rb = _mm_and_si128(p, _mm_set1_epi32(0x00ff00ff));
+            rb = _mm_shufflehi_epi16(_mm_shufflelo_epi16(rb, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+            p = _mm_or_si128(_mm_and_si128(p, _mm_set1_epi32(0x0000ff00)), rb);
+            p = _mm_or_si128(_mm_and_si128(p, _mm_set1_epi64x(0xffffff)), _mm_and_si128(_mm_srli_epi64(p, 8), _mm_set1_epi64x(0xffffff000000)));
+            p = _mm_or_si128(_mm_move_epi64(p), _mm_slli_si128(_mm_srli_si128(p, 8), 6));
+#endif
+            _mm_storeu_si128((__m128i*) (d + x * 3), p);
+        }
+        // x86 is little endian, so a pixel goes out as one 4-byte store whose
+        // spare byte the next pixel overwrites
+        for (; x + 1 < w; x++) {
+            uint32_t v = s[x].r | (s[x].g << 8) | (s[x].b << 16);
+            memcpy(d + x * 3, &v, 4);
+        }
+    }
+#endif
+    for (; x < w; x++) {
+        kit_Color c = kit__unpremultiply(s[x]);
+        uint8_t *p = d + x * bpp;
+        p[0] = c.r; p[1] = c.g; p[2] = c.b;
+        if (bpp == 4) { p[3] = c.a; }
     }
+}
 
-    free(data);
-    return bmp;
 
-err:
-    if (data) { free(data); }
-    if (bmp)  { free(bmp);  }
-    return NULL;
+// true if every pixel has full alpha
+static bool kit__png_opaque(kit_Image *img) {
+    const kit_Color *p = img->pixels;
+    int n = img->w * img->h, i = 0;
+#if defined(KIT__SSE2) || defined(KIT__AVX2)
+    // 64 pixels are anded together per check, which stops at the first
+    // block with a translucent pixel
+    __m128i alpha = _mm_set1_epi32(0xff000000);
+    for (; i + 64 <= n; i += 64) {
+        __m128i acc = alpha;
+        for (int k = 0; k < 64; k += 4) { acc = _mm_and_si128(acc, _mm_loadu_si128((__m128i*) (p + i + k))); }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(acc, alpha)) != 0xffff) { return false; }
+    }
+#endif
+    uint8_t a = 0xff;
+    for (; i < n; i++) { a &= p[i].a; }
+    return a == 0xff;
+}
+
+
+static void kit__png_encode(kit__PngEncoder *e, kit_Image *img) {
+    kit__png_tables(e);
+
+    // opaque images are written as rgb
+    bool opaque = kit__png_opaque(img);
+    int bpp = opaque ? 3 : 4;
+    int n = img->w * bpp;
+    e->bpp = bpp;
+
+    kit__png_out(e, "\211PNG\r\n\032\n", 8);
+    uint8_t ihdr[13] = { [8] = 8, [9] = opaque ? 2 : 6 };
+    kit__put32be(ihdr, img->w);
+    kit__put32be(ihdr + 4, img->h);
+    kit__png_chunk(e, "IHDR", ihdr, 13);
+
+    // zlib header: deflate, 32k window, no dictionary
+    uint8_t zhdr[2] = { 0x78, 0x01 };
+    kit__put_bytes(e, zhdr, 2);
+    e->adler = 1;
+
+    // every row keeps its filter type byte in front
+    uint8_t *rows = kit__alloc((n + 1) * 7);
+    uint8_t *cur = rows + 1, *prev = rows + (n + 1) + 1, *out[5];
+    for (int f = 0; f < 5; f++) {
+        out[f] = rows + (n + 1) * (f + 2) + 1;
+        out[f][-1] = f;
+    }
+    for (int y = 0; y < img->h; y++) {
+        kit__png_pack_row(cur, &img->pixels[y * img->w], img->w, bpp);
+        uint8_t *row = cur;
+        if (e->mode != KIT_SAVE_STORE) { row = kit__png_filter_row(e->mode, bpp, n, cur, prev, out); }
+        kit__deflate_write(e, row - 1, n + 1);
+        uint8_t *t = cur; cur = prev; prev = t;
+    }
+    free(rows);
+
+    kit__deflate_finish(e);
+    kit__png_chunk(e, "IEND", NULL, 0);
+}
+
+
+void* kit_save_image_mem(kit_Image *img, int mode, int *len) {
+    kit__PngEncoder *e = kit__alloc(sizeof(kit__PngEncoder));
+    e->mode = mode;
+    kit__png_encode(e, img);
+    void *res = e->mem;
+    if (len) { *len = e->mem_len; }
+    free(e);
+    return res;
+}
+
+
+bool kit_save_image_file(kit_Image *img, char *filename, int mode) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) { return false; }
+    kit__PngEncoder *e = kit__alloc(sizeof(kit__PngEncoder));
+    e->mode = mode;
+    e->fp = fp;
+    kit__png_encode(e, img);
+    bool ok = !e->failed;
+    free(e);
+    if (fclose(fp)) { ok = false; }
+    return ok;
 }
 
-#undef CHECK
-#undef FAIL
 
 
 //////////////////////////////////////////////////////////////////////////////
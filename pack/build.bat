@@ -0,0 +1 @@
+gcc main.c -o pack.exe -std=c99 -Wall -lgdi32 -luser32 -lwinmm -O2 -s
\ No newline at end of file
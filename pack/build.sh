@@ -0,0 +1 @@
+gcc main.c -o pack -std=c99 -Wall -O2 -s -lm -lpthread
\ No newline at end of file
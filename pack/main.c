@@ -0,0 +1,127 @@
+// offline packer for kit asset packs. pngs are decoded (on every core) and
+// written out as kit_Color pixels with their font glyph tables, so a game can
+// kit_open_pack() the result and use the assets without decoding anything.
+//
+// usage: pack out.pack [-f | -i] [name=]file.png ...
+//   -f  the files that follow are fonts
+//   -i  the files that follow are images (the default)
+//   an asset is named by its path as given unless a name is supplied
+
+#ifndef KIT_HEADLESS
+#define KIT_HEADLESS
+#endif
+#define KIT_IMPL
+#include "../kit.h"
+
+typedef struct {
+    uint8_t *data;
+    size_t len, cap;
+} Buffer;
+
+
+static uint32_t reserve(Buffer *b, size_t n, size_t align) {
+    size_t at = (b->len + align - 1) / align * align;
+    if (at + n > 0xffffffff) {
+        fprintf(stderr, "pack is too big\n");
+        exit(1);
+    }
+    if (at + n > b->cap) {
+        b->cap = kit_max(at + n, b->cap * 2);
+        b->data = realloc(b->data, b->cap);
+        if (!b->data) { kit__panic("out of memory"); }
+    }
+    memset(b->data + b->len, 0, at + n - b->len);
+    b->len = at + n;
+    return at;
+}
+
+
+static uint32_t append(Buffer *b, const void *data, size_t n, size_t align) {
+    uint32_t at = reserve(b, n, align);
+    memcpy(b->data + at, data, n);
+    return at;
+}
+
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s out.pack [-f | -i] [name=]file.png ...\n", argv[0]);
+        return 1;
+    }
+
+    kit_Asset *assets = kit__alloc(argc * sizeof(kit_Asset));
+    char **names = kit__alloc(argc * sizeof(char*));
+    int count = 0, type = KIT_ASSET_IMAGE;
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "-f")) {
+            type = KIT_ASSET_FONT;
+        } else if (!strcmp(argv[i], "-i")) {
+            type = KIT_ASSET_IMAGE;
+        } else {
+            char *eq = strchr(argv[i], '=');
+            names[count] = argv[i];
+            assets[count].filename = argv[i];
+            if (eq) {
+                *eq = '\0';
+                assets[count].filename = eq + 1;
+            }
+            assets[count++].type = type;
+        }
+    }
+
+    kit_Batch *batch = kit_load_batch(assets, count, 0);
+    kit_Asset *a;
+    while ((a = kit_batch_wait(batch))) {
+        if (!a->result) { fprintf(stderr, "could not load %s\n", a->filename); }
+    }
+    int failed;
+    kit_batch_stats(batch, NULL, &failed);
+    kit_destroy_batch(batch);
+    if (failed) { return 1; }
+
+    // header, entries and index first, then the data they point at
+    int slot_count = 1;
+    while (slot_count < count * 2) { slot_count *= 2; }
+    Buffer out = {0};
+    reserve(&out, sizeof(kit__PackHeader) + count * sizeof(kit__PackEntry) + slot_count * sizeof(uint32_t), 1);
+    kit__PackEntry *entries = kit__alloc(kit_max(count, 1) * sizeof(kit__PackEntry));
+    uint32_t *slots = kit__alloc(slot_count * sizeof(uint32_t));
+
+    for (int i = 0; i < count; i++) {
+        kit__PackEntry *e = &entries[i];
+        kit_Image *img = assets[i].result;
+        if (assets[i].type == KIT_ASSET_FONT) {
+            kit_Font *font = assets[i].result;
+            img = font->image;
+            e->glyphs = append(&out, font->glyphs, sizeof(font->glyphs), 4);
+        }
+        e->hash = kit__pack_hash(names[i]);
+        e->name = append(&out, names[i], strlen(names[i]) + 1, 1);
+        e->type = assets[i].type;
+        e->w = img->w;
+        e->h = img->h;
+        e->pixels = append(&out, img->pixels, img->w * img->h * sizeof(kit_Color), 64);
+
+        uint32_t j = e->hash & (slot_count - 1);
+        for (; slots[j]; j = (j + 1) & (slot_count - 1)) {
+            if (!strcmp(names[slots[j] - 1], names[i])) {
+                fprintf(stderr, "duplicate name %s\n", names[i]);
+                return 1;
+            }
+        }
+        slots[j] = i + 1;
+    }
+
+    kit__PackHeader header = { KIT__PACK_MAGIC, KIT__PACK_VERSION, KIT__PACK_FLAGS, count, slot_count };
+    memcpy(out.data, &header, sizeof(header));
+    memcpy(out.data + sizeof(header), entries, count * sizeof(kit__PackEntry));
+    memcpy(out.data + sizeof(header) + count * sizeof(kit__PackEntry), slots, slot_count * sizeof(uint32_t));
+
+    FILE *fp = fopen(argv[1], "wb");
+    if (!fp || fwrite(out.data, 1, out.len, fp) != out.len || fclose(fp)) {
+        fprintf(stderr, "could not write %s\n", argv[1]);
+        return 1;
+    }
+    printf("%s: %d assets, %lu bytes\n", argv[1], count, (unsigned long) out.len);
+    return 0;
+}